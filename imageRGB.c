@@ -22,12 +22,18 @@
 #include "imageRGB.h"
 
 #include <assert.h>
-#include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "PixelCoords.h"
 #include "PixelCoordsQueue.h"
 #include "PixelCoordsStack.h"
@@ -35,17 +41,60 @@
 
 // The data structure
 //
-// A RGB image is stored in a structure containing 5 fields:
+// A RGB image is stored in a structure containing 18 fields:
 // Two integers store the image width and height.
-// The next field is a pointer to an array that stores the pointers
-// to the image rows.
+// The pixel labels of all rows are stored in a single block of memory,
+// aligned to PIXEL_ALIGN bytes. Row v starts at pixels + v * stride,
+// where stride (in bytes) leaves room for width pixels plus padding.
+// Padding pixels at the end of each row are always WHITE,
+// so whole images with equal dimensions (and depth) may be copied or
+// compared with a single memcpy/memcmp.
+// Labels are stored with depth bits per pixel, the fewest that can hold
+// every label of the LUT (see DepthForColors):
+//  - 1 bit for 2-color (WHITE/BLACK) images, packed most significant bit
+//    first exactly like a PBM row, with rows padded to 64-bit words;
+//  - 8 bits (uint8) for images with up to 256 colors;
+//  - 16 bits (uint16) otherwise.
+// 8- and 16-bit rows are aligned to PIXEL_ALIGN.
+// The depth only grows: LUTAppendColor widens the pixel block when a
+// new label no longer fits.
+// pixmem is the allocated block that contains pixels, and pixcap the
+// number of bytes usable from pixels: at least height * stride, and more
+// after an in-place rotation has shrunk the image (ImageRotate90CWInPlace
+// only grows the block beyond pixcap).
+// The LUT maps labels to RGB colors. It starts in the small lut_inline
+// array inside the structure and moves to the heap, growing
+// geometrically, when more than LUT_INLINE_SIZE colors are needed.
+// Up to LUT_MAX_COLORS labels (the range of uint16) are supported.
+// Heap LUTs are paired with a hash index (lut_hash, open addressing
+// with linear probing) that maps colors back to labels, so that
+// LUTFindColor does not need to scan the LUT.
+// A fingerprint (a hash of the colors of all pixels, by position) is
+// computed on request (ImageFingerprint) and kept until the image
+// changes: LUTAppendColor and every function that writes pixels of an
+// existing image call InvalidateFingerprint.
+// A view (see ImageView) is a structure with no pixels and no LUT of its
+// own: base points to the image it shows, in the given orientation, and
+// its pixels and colors are read from (and filled into) base.  A view
+// takes its dimensions from base when it is created, so base counts its
+// live views in views, and refuses to change shape in place (rotate 90
+// degrees a non-square image) while it has any.
 //
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
 // structure fields directly.
 
-// FIXED SIZE of LUT for storing RGB triplets
-#define FIXED_LUT_SIZE 1000
+// Number of LUT entries stored inside the image structure
+#define LUT_INLINE_SIZE 4
+
+// Maximum number of LUT entries (labels 0..65534 fit in a uint16)
+#define LUT_MAX_COLORS 65535
+
+// Number of generated colors in the LUT of ImageCreatePalete
+#define PALETE_SIZE 1000
+
+// Alignment (in bytes) of the pixel block and of each image row
+#define PIXEL_ALIGN 64
 
 #define BACKGROUND WHITE
 
@@ -54,9 +103,22 @@ struct image
 {
   uint32 width;
   uint32 height;
-  uint16 **image;    // pointer to an array of pointers referencing the image rows
+  uint32 stride;     // distance (in bytes) between consecutive rows
+  uint32 depth;      // bits per pixel label: 1, 8 or 16
+  uint8 *pixels;     // aligned block with height rows of pixel labels
+  void *pixmem;      // the allocated block that contains pixels
+  size_t pixcap;     // bytes usable from pixels (at least height*stride)
   uint16 num_colors; // the number of colors (i.e., pixel labels) used
   rgb_t *LUT;        // table storing (R,G,B) triplets
+  uint32 lut_capacity; // number of entries allocated for LUT
+  uint16 *lut_hash;  // color->label index: slots hold label+1 (0 = empty)
+  uint32 lut_hash_bits; // lut_hash has 2^lut_hash_bits slots
+  rgb_t lut_inline[LUT_INLINE_SIZE]; // LUT storage for small LUTs
+  uint64_t fingerprint; // hash of the pixel colors (see ImageFingerprint)
+  int has_fingerprint;  // fingerprint is up to date
+  Image base;           // for a view: the image it shows (else NULL)
+  uint32 orientation;   // for a view: an Orientation of base
+  uint32 views;         // number of live views of this image
 };
 
 // Design by Contract
@@ -108,6 +170,8 @@ void ImageInit(void)
   InstrName[7] = "peak_stack";      // InstrCount[7] = peak stack usage
   InstrName[8] = "peak_queue";      // InstrCount[8] = peak queue usage
   InstrName[9] = "peak_rec_depth";  // InstrCount[9] = peak recursion depth
+  // Peaks of different threads are merged with max, not added
+  InstrPeak[7] = InstrPeak[8] = InstrPeak[9] = 1;
 }
 
 // Macros to simplify accessing instrumentation counters:
@@ -122,15 +186,129 @@ void ImageInit(void)
 #define PEAKQUEUE InstrCount[8]
 #define PEAKRECDEPTH InstrCount[9]
 
-// TIP: Search for PIXMEM or InstrCount to see where it is incremented!
+// All counting goes through these macros:
+//   COUNT(counter, n)         adds n operations;
+//   COUNT_PEAK(counter, x)    raises a peak counter to x, if greater;
+//   COUNT_SET(counter, x)     sets a peak counter (at the start of an operation).
+// The counters are globals that the compiler cannot keep in registers, so
+// they slow down the tight loops. Compiling with -DIMAGE_NO_INSTR turns the
+// macros into no-ops, for uncounted builds (see the *_fast Makefile targets).
+#ifdef IMAGE_NO_INSTR
+#define COUNT(counter, n) ((void)0)
+#define COUNT_PEAK(counter, x) ((void)0)
+#define COUNT_SET(counter, x) ((void)0)
+#else
+#define COUNT(counter, n) ((counter) += (n))
+#define COUNT_PEAK(counter, x)                          \
+  do                                                    \
+  {                                                     \
+    if ((unsigned long)(x) > (counter))                 \
+      (counter) = (unsigned long)(x);                   \
+  } while (0)
+#define COUNT_SET(counter, x) ((counter) = (unsigned long)(x))
+#endif
+
+// TIP: Search for COUNT or InstrCount to see where it is incremented!
 
 /// Auxiliary (static) functions
 
+// Home slot of color in the LUT hash index (Fibonacci hashing).
+static inline uint32 LUTHashSlot(const Image img, rgb_t color)
+{
+  return (uint32)(color * 2654435769u) >> (32 - img->lut_hash_bits);
+}
+
+// Add label to the hash index, unless its color is already indexed.
+// (The first label with a given color is the one that must be found.)
+static void LUTHashInsert(Image img, uint16 label)
+{
+  const uint32 mask = (1u << img->lut_hash_bits) - 1;
+  rgb_t color = img->LUT[label];
+  uint32 slot = LUTHashSlot(img, color);
+  while (img->lut_hash[slot] != 0)
+  {
+    if (img->LUT[img->lut_hash[slot] - 1] == color)
+      return;
+    slot = (slot + 1) & mask;
+  }
+  img->lut_hash[slot] = label + 1;
+}
+
+// Make room for at least n LUT entries.
+// The LUT grows geometrically, and the hash index is (re)built so that it
+// always has at least twice as many slots as the LUT has entries.
+static void LUTReserve(Image img, uint32 n)
+{
+  assert(n <= LUT_MAX_COLORS);
+  if (n <= img->lut_capacity)
+    return;
+
+  uint32 capacity = 2 * img->lut_capacity;
+  if (capacity < n)
+    capacity = n;
+  if (capacity > LUT_MAX_COLORS)
+    capacity = LUT_MAX_COLORS;
+
+  if (img->LUT == img->lut_inline)
+  {
+    img->LUT = malloc(capacity * sizeof(rgb_t));
+    // Error handling
+    check(img->LUT != NULL, "Alloc failed ->LUT array");
+    memcpy(img->LUT, img->lut_inline, img->num_colors * sizeof(rgb_t));
+  }
+  else
+  {
+    rgb_t *LUT = realloc(img->LUT, capacity * sizeof(rgb_t));
+    // Error handling
+    check(LUT != NULL, "Alloc failed ->LUT array");
+    img->LUT = LUT;
+  }
+  img->lut_capacity = capacity;
+
+  // Rebuild the hash index with the new size
+  uint32 bits = 4;
+  while ((1u << bits) < 2 * capacity)
+    bits++;
+  free(img->lut_hash);
+  img->lut_hash = calloc((size_t)1 << bits, sizeof(uint16));
+  // Error handling
+  check(img->lut_hash != NULL, "Alloc failed ->lut_hash array");
+  img->lut_hash_bits = bits;
+  for (uint32 label = 0; label < img->num_colors; label++)
+    LUTHashInsert(img, (uint16)label);
+}
+
+static void ImageWiden(Image img);
+
+// Forget the fingerprint of img (its contents are about to change).
+static inline void InvalidateFingerprint(Image img)
+{
+  img->has_fingerprint = 0;
+}
+
+// Append color as a new LUT entry and keep the hash index in sync.
+// If the image has pixels and the new label does not fit their depth,
+// the pixel block is widened.
+static uint16 LUTAppendColor(Image img, rgb_t color)
+{
+  assert(img->base == NULL); // views borrow the LUT of their base
+  check(img->num_colors < LUT_MAX_COLORS, "LUT Overflow");
+  LUTReserve(img, img->num_colors + 1u);
+  uint16 label = img->num_colors++;
+  img->LUT[label] = color;
+  if (img->lut_hash != NULL)
+    LUTHashInsert(img, label);
+  InvalidateFingerprint(img);
+  if (img->pixels != NULL && img->depth < 16 && label >> img->depth != 0)
+    ImageWiden(img);
+  return label;
+}
+
 static Image AllocateImageHeader(uint32 width, uint32 height)
 {
   // Create the header of an image data structure
-  // Allocate the array of pointers to rows
   // And the look-up table
+  // (The pixel block is allocated separately by AllocatePixels)
 
   Image newHeader = malloc(sizeof(struct image));
   // Error handling
@@ -138,43 +316,473 @@ static Image AllocateImageHeader(uint32 width, uint32 height)
 
   newHeader->width = width;
   newHeader->height = height;
+  newHeader->stride = 0;
+  newHeader->depth = 0;
+  newHeader->pixels = NULL;
+  newHeader->pixmem = NULL;
+  newHeader->pixcap = 0;
+
+  // The LUT starts inline, with no hash index
+  newHeader->LUT = newHeader->lut_inline;
+  newHeader->lut_capacity = LUT_INLINE_SIZE;
+  newHeader->lut_hash = NULL;
+  newHeader->lut_hash_bits = 0;
+  newHeader->fingerprint = 0;
+  newHeader->has_fingerprint = 0;
+  newHeader->base = NULL;
+  newHeader->orientation = ORIENT_IDENTITY;
+  newHeader->views = 0;
 
-  // Allocating the array of pointers to image rows
-  newHeader->image = malloc(height * sizeof(uint16 *));
-  // Error handling
-  check(newHeader->image != NULL, "Alloc failed ->image array");
+  // Initialize LUT with 2 fixed colors
+  newHeader->num_colors = 0;
+  LUTAppendColor(newHeader, 0xffffff); // RGB WHITE
+  LUTAppendColor(newHeader, 0x000000); // RGB BLACK
+
+  return newHeader;
+}
+
+// Number of bits per pixel needed to store labels 0..num_colors-1.
+static inline uint32 DepthForColors(uint32 num_colors)
+{
+  if (num_colors <= 2)
+    return 1;
+  return num_colors <= 256 ? 8 : 16;
+}
+
+// Bytes per row of a width-pixel image with the given depth (bits):
+// whole 64-bit words for 1-bit rows, PIXEL_ALIGN multiples otherwise.
+static uint32 StrideFor(uint32 width, uint32 depth)
+{
+  if (depth == 1)
+    return (width + 63) / 64 * 8;
+  return (width * (depth / 8) + PIXEL_ALIGN - 1) / PIXEL_ALIGN * PIXEL_ALIGN;
+}
+
+// Allocate the pixel block of img, with all pixels (and padding) WHITE,
+// with the depth required by the current LUT.
+// calloc is used so that large blocks get zeroed pages from the OS lazily.
+static void AllocatePixels(Image img)
+{
+  img->depth = DepthForColors(img->num_colors);
+  img->stride = StrideFor(img->width, img->depth);
 
-  // Allocating the LUT
-  newHeader->LUT = malloc(FIXED_LUT_SIZE * sizeof(rgb_t));
+  size_t bytes = (size_t)img->height * img->stride;
+  img->pixmem = calloc(bytes + PIXEL_ALIGN, 1);
   // Error handling
-  check(newHeader->LUT != NULL, "Alloc failed ->LUT array");
+  check(img->pixmem != NULL, "AllocatePixels");
+  img->pixcap = bytes;
 
-  // Initialize LUT with 2 fixed colors
-  newHeader->num_colors = 2;
-  newHeader->LUT[0] = 0xffffff; // RGB WHITE
-  newHeader->LUT[1] = 0x000000; // RGB BLACK
+  uintptr_t addr = (uintptr_t)img->pixmem;
+  addr = (addr + PIXEL_ALIGN - 1) & ~(uintptr_t)(PIXEL_ALIGN - 1);
+  img->pixels = (uint8 *)addr;
+}
 
-  return newHeader;
+// Pointer to the first byte of row v.
+static inline uint8 *ImageRowBytes(const Image img, uint32 v)
+{
+  return img->pixels + (size_t)v * img->stride;
+}
+
+// Pointer to the first pixel of row v (of a 16-bit image).
+static inline uint16 *ImageRow(const Image img, uint32 v)
+{
+  assert(img->depth == 16);
+  return (uint16 *)ImageRowBytes(img, v);
+}
+
+// Pointer to the first pixel of row v (of an 8-bit image).
+static inline uint8 *ImageRow8(const Image img, uint32 v)
+{
+  assert(img->depth == 8);
+  return ImageRowBytes(img, v);
+}
+
+// Size (in bytes) of the whole pixel block, including row padding.
+static inline size_t ImagePixelBytes(const Image img)
+{
+  return (size_t)img->height * img->stride;
+}
+
+// Label of pixel (u, v), for any depth.
+static inline uint16 PixelGet(const Image img, uint32 u, uint32 v)
+{
+  const uint8 *row = ImageRowBytes(img, v);
+  if (img->depth == 8)
+    return row[u];
+  if (img->depth == 1)
+    return (row[u >> 3] >> (7 - (u & 7))) & 1;
+  return ((const uint16 *)row)[u];
+}
+
+// The image that holds the pixels and the LUT of img: its base, if img
+// is a view.
+static inline Image ImageBase(const Image img)
+{
+  return img->base != NULL ? img->base : img;
+}
+
+// Coordinates, in its base, of pixel (u, v) of view.
+static inline void ViewToBase(const Image view, uint32 *u, uint32 *v)
+{
+  uint32 a = (view->orientation & ORIENT_FLIP_HORIZONTAL) ? view->width - 1 - *u : *u;
+  uint32 b = (view->orientation & ORIENT_FLIP_VERTICAL) ? view->height - 1 - *v : *v;
+  if (view->orientation & ORIENT_TRANSPOSE)
+  {
+    *u = b;
+    *v = a;
+  }
+  else
+  {
+    *u = a;
+    *v = b;
+  }
+}
+
+// Set the label of pixel (u, v), for any depth.
+static inline void PixelSet(Image img, uint32 u, uint32 v, uint16 label)
+{
+  uint8 *row = ImageRowBytes(img, v);
+  if (img->depth == 8)
+  {
+    row[u] = (uint8)label;
+  }
+  else if (img->depth == 1)
+  {
+    uint8 bit = (uint8)(0x80 >> (u & 7));
+    row[u >> 3] = label ? row[u >> 3] | bit : row[u >> 3] & ~bit;
+  }
+  else
+  {
+    ((uint16 *)row)[u] = label;
+  }
+}
+
+// Set (bit = 1) or clear (bit = 0) bits [u0, u1) of a 1-bit row.
+static void setBitSpan(uint8 *row, uint32 u0, uint32 u1, int bit)
+{
+  if (u0 >= u1)
+    return;
+  // Whole bytes in the middle, partial bytes at both ends
+  uint8 fill = bit ? 0xff : 0x00;
+  uint32 b0 = u0 >> 3, b1 = (u1 - 1) >> 3;
+  uint8 first = (uint8)(0xff >> (u0 & 7));
+  uint8 last = (uint8)(0xff << (7 - ((u1 - 1) & 7)));
+  if (b0 == b1)
+  {
+    uint8 mask = first & last;
+    row[b0] = (uint8)((row[b0] & ~mask) | (fill & mask));
+    return;
+  }
+  row[b0] = (uint8)((row[b0] & ~first) | (fill & first));
+  memset(row + b0 + 1, fill, b1 - b0 - 1);
+  row[b1] = (uint8)((row[b1] & ~last) | (fill & last));
+}
+
+// Set the labels of pixels [u0, u1) of row v, for any depth.
+static void PixelSetSpan(Image img, uint32 v, uint32 u0, uint32 u1, uint16 label)
+{
+  if (u0 >= u1)
+    return;
+  if (img->depth == 16)
+  {
+    uint16 *row = ImageRow(img, v);
+    for (uint32 u = u0; u < u1; u++)
+      row[u] = label;
+    return;
+  }
+  if (img->depth == 8)
+  {
+    memset(ImageRow8(img, v) + u0, label, u1 - u0);
+    return;
+  }
+  setBitSpan(ImageRowBytes(img, v), u0, u1, label != 0);
+}
+
+/// Packed (1-bit) rows
+
+// 1-bit rows use the PBM layout: one bit per pixel, set for BLACK,
+// most significant bit first. These helpers convert them from and to
+// rows of uint16 labels.
+
+// Table with the labels (WHITE=0 or BLACK=1) of the 8 pixels packed in
+// each possible byte, most significant bit first.
+static uint16 BitsToLabels[256][8];
+
+// Expand the packed bits of a 1-bit row into width labels,
+// 8 pixels (one table entry) at a time.
+static void unpackBitsToLabels(uint32 width, const uint8 bytes[], uint16 row[])
+{
+  uint32 full = width / 8;
+  for (uint32 b = 0; b < full; b++)
+  {
+    memcpy(row + 8 * b, BitsToLabels[bytes[b]], 8 * sizeof(uint16));
+  }
+  // The last byte may have padding bits, which are ignored
+  if (width % 8 != 0)
+  {
+    memcpy(row + 8 * full, BitsToLabels[bytes[full]], (width % 8) * sizeof(uint16));
+  }
+}
+
+// Bit-reversal of each byte (to turn LSB-first masks into MSB-first bytes)
+static uint8 ReverseBits[256];
+
+static pthread_once_t BitTablesOnce = PTHREAD_ONCE_INIT;
+
+static void InitBitTables(void)
+{
+  for (int byte = 0; byte < 256; byte++)
+  {
+    uint8 r = 0;
+    for (int bit = 0; bit < 8; bit++)
+    {
+      BitsToLabels[byte][bit] = (byte >> (7 - bit)) & 1;
+      r |= ((byte >> bit) & 1) << (7 - bit);
+    }
+    ReverseBits[byte] = r;
+  }
+}
+
+// Pack the labels of pixels [8*b0, 8*b1) of a row into bytes [b0, b1):
+// one bit per pixel, set for non-WHITE pixels, most significant bit first.
+// Reads whole bytes of pixels: pixels past the image width must be the
+// WHITE row padding, so that padding bits are 0.
+static void packLabelsToBits(uint32 b0, uint32 b1, const uint16 row[], uint8 bytes[])
+{
+  uint32 b = b0;
+#if defined(__SSE2__)
+  // 16 pixels per step: compare with WHITE, pack to bytes, movemask
+  const __m128i white = _mm_setzero_si128();
+  for (; b + 2 <= b1; b += 2)
+  {
+    __m128i lo = _mm_load_si128((const __m128i *)(row + 8 * b));
+    __m128i hi = _mm_load_si128((const __m128i *)(row + 8 * b + 8));
+    __m128i is_white = _mm_packs_epi16(_mm_cmpeq_epi16(lo, white), _mm_cmpeq_epi16(hi, white));
+    unsigned mask = ~(unsigned)_mm_movemask_epi8(is_white);
+    bytes[b] = ReverseBits[mask & 0xff];
+    bytes[b + 1] = ReverseBits[(mask >> 8) & 0xff];
+  }
+#endif
+  for (; b < b1; b++)
+  {
+    const uint16 *p = row + 8 * b;
+    bytes[b] = (uint8)((p[0] != WHITE) << 7 | (p[1] != WHITE) << 6 |
+                       (p[2] != WHITE) << 5 | (p[3] != WHITE) << 4 |
+                       (p[4] != WHITE) << 3 | (p[5] != WHITE) << 2 |
+                       (p[6] != WHITE) << 1 | (p[7] != WHITE));
+  }
 }
 
-// Allocate row of background (label=0) pixels
-static uint16 *AllocateRowArray(uint32 size)
+// Allocate a buffer for one row of uint16 labels of img, aligned and
+// with WHITE padding, as required by packLabelsToBits.
+static uint16 *AllocateLabelRow(const Image img)
 {
-  uint16 *newArray = calloc((size_t)size, sizeof(uint16));
+  size_t bytes = ((img->width * sizeof(uint16)) + PIXEL_ALIGN - 1) / PIXEL_ALIGN * PIXEL_ALIGN;
+  uint16 *labels = aligned_alloc(PIXEL_ALIGN, bytes);
   // Error handling
-  check(newArray != NULL, "AllocateRowArray");
+  check(labels != NULL, "Alloc failed ->label row");
+  memset(labels, 0, bytes);
+  return labels;
+}
+
+static const uint16 *ViewRowLabels(const Image view, uint32 v, uint16 labels[]);
+
+// The labels of row v of img, as uint16.
+// 16-bit rows are returned directly; other rows (and rows of views) are
+// expanded into labels (a buffer from AllocateLabelRow).
+static const uint16 *ImageRowLabels(const Image img, uint32 v, uint16 labels[])
+{
+  if (img->base != NULL)
+    return ViewRowLabels(img, v, labels);
+  if (img->depth == 16)
+    return ImageRow(img, v);
+  if (img->depth == 8)
+  {
+    const uint8 *row = ImageRow8(img, v);
+    for (uint32 u = 0; u < img->width; u++)
+      labels[u] = row[u];
+    return labels;
+  }
+  pthread_once(&BitTablesOnce, InitBitTables);
+  unpackBitsToLabels(img->width, ImageRowBytes(img, v), labels);
+  return labels;
+}
+
+// The labels of row v of view, gathered from its base: a row of the base
+// (reversed by ORIENT_FLIP_HORIZONTAL), or a column if the axes swap.
+static const uint16 *ViewRowLabels(const Image view, uint32 v, uint16 labels[])
+{
+  const Image base = view->base;
+  uint32 width = view->width;
+  int flip_u = (view->orientation & ORIENT_FLIP_HORIZONTAL) != 0;
+  uint32 x = 0, y = v;
+  ViewToBase(view, &x, &y);
+
+  if (!(view->orientation & ORIENT_TRANSPOSE))
+  {
+    if (flip_u && base->depth == 8)
+    {
+      const uint8 *row8 = ImageRow8(base, y) + (width - 1);
+      for (uint32 u = 0; u < width; u++)
+        labels[u] = *row8--;
+      return labels;
+    }
+    const uint16 *row = ImageRowLabels(base, y, labels);
+    if (!flip_u)
+    {
+      if (row != labels)
+        memcpy(labels, row, width * sizeof(uint16));
+      return labels;
+    }
+    if (row == labels)
+    {
+      for (uint32 i = 0, j = width - 1; i < j; i++, j--)
+      {
+        uint16 tmp = labels[i];
+        labels[i] = labels[j];
+        labels[j] = tmp;
+      }
+      return labels;
+    }
+    for (uint32 u = 0; u < width; u++)
+      labels[u] = row[width - 1 - u];
+    return labels;
+  }
+
+  // Row v is column x of the base, from row y down (or up, if flipped)
+  for (uint32 u = 0; u < width; u++)
+    labels[u] = PixelGet(base, x, flip_u ? y - u : y + u);
+  return labels;
+}
+
+// Reads the rows of an image or a view, in order, as uint16 labels.
+// Rows of a view that swaps the axes are columns of its base: they are
+// gathered VIEW_BAND at a time, walking the base row by row, so that
+// each cache line of the base is read once, not once per row.
+#define VIEW_BAND 64
+
+typedef struct
+{
+  Image img;
+  uint16 *labels;     // one row (from AllocateLabelRow)
+  uint16 *band;       // VIEW_BAND rows, for views that swap the axes
+  size_t band_stride; // labels between rows of band (as AllocateLabelRow)
+  uint32 band_v0;     // first row held in band
+} RowReader;
+
+static void RowReaderInit(RowReader *reader, const Image img)
+{
+  reader->img = img;
+  reader->labels = AllocateLabelRow(img);
+  reader->band = NULL;
+  reader->band_stride = ((img->width * sizeof(uint16)) + PIXEL_ALIGN - 1) / PIXEL_ALIGN * PIXEL_ALIGN / sizeof(uint16);
+  reader->band_v0 = UINT32_MAX;
+  if (img->base != NULL && (img->orientation & ORIENT_TRANSPOSE))
+  {
+    size_t bytes = VIEW_BAND * reader->band_stride * sizeof(uint16);
+    reader->band = aligned_alloc(PIXEL_ALIGN, bytes);
+    // Error handling
+    check(reader->band != NULL, "Alloc failed ->view band");
+    memset(reader->band, 0, bytes);
+  }
+}
+
+static void RowReaderFree(RowReader *reader)
+{
+  free(reader->labels);
+  free(reader->band);
+}
+
+// The labels of row v (a row of AllocateLabelRow layout).
+static const uint16 *RowReaderRow(RowReader *reader, uint32 v)
+{
+  const Image img = reader->img;
+  if (reader->band == NULL)
+    return ImageRowLabels(img, v, reader->labels);
+
+  if (v < reader->band_v0 || v - reader->band_v0 >= VIEW_BAND)
+  {
+    uint32 v0 = v / VIEW_BAND * VIEW_BAND;
+    uint32 rows = img->height - v0 < VIEW_BAND ? img->height - v0 : VIEW_BAND;
+    // Pixel (u, v0+j) of the view is pixel (x0 -/+ j, y0 -/+ u) of the base
+    uint32 x0 = 0, y0 = v0;
+    ViewToBase(img, &x0, &y0);
+    int flip_u = (img->orientation & ORIENT_FLIP_HORIZONTAL) != 0;
+    int flip_v = (img->orientation & ORIENT_FLIP_VERTICAL) != 0;
+    // In tiles of VIEW_BAND columns, which stay in cache
+    for (uint32 u0 = 0; u0 < img->width; u0 += VIEW_BAND)
+    {
+      uint32 u1 = img->width - u0 < VIEW_BAND ? img->width : u0 + VIEW_BAND;
+      for (uint32 j = 0; j < rows; j++)
+      {
+        uint32 x = flip_v ? x0 - j : x0 + j;
+        uint16 *dst = reader->band + j * reader->band_stride;
+        for (uint32 u = u0; u < u1; u++)
+          dst[u] = PixelGet(img->base, x, flip_u ? y0 - u : y0 + u);
+      }
+    }
+    reader->band_v0 = v0;
+  }
+  return reader->band + (v - reader->band_v0) * reader->band_stride;
+}
+
+// Store the uint16 labels (a buffer from AllocateLabelRow) in row v of img.
+static void ImageStoreRowLabels(Image img, uint32 v, const uint16 labels[])
+{
+  if (img->depth == 16)
+  {
+    memcpy(ImageRow(img, v), labels, img->width * sizeof(uint16));
+    return;
+  }
+  if (img->depth == 8)
+  {
+    uint8 *row = ImageRow8(img, v);
+    for (uint32 u = 0; u < img->width; u++)
+      row[u] = (uint8)labels[u];
+    return;
+  }
+  pthread_once(&BitTablesOnce, InitBitTables);
+  packLabelsToBits(0, (img->width + 8 - 1) / 8, labels, ImageRowBytes(img, v));
+}
+
+// Reallocate the pixel block of img with the depth required by its LUT,
+// converting all the labels.
+static void ImageWiden(Image img)
+{
+  assert(DepthForColors(img->num_colors) > img->depth);
 
-  return newArray;
+  struct image old = *img;
+  AllocatePixels(img);
+  uint16 *labels = AllocateLabelRow(img);
+  for (uint32 v = 0; v < img->height; v++)
+    ImageStoreRowLabels(img, v, ImageRowLabels(&old, v, labels));
+  free(labels);
+  free(old.pixmem);
 }
 
 /// Find color label for given RGB color in img LUT.
 /// Return the label or -1 if not found.
 static int LUTFindColor(Image img, rgb_t color)
 {
-  for (uint16 index = 0; index < img->num_colors; index++)
+  if (img->lut_hash == NULL)
+  {
+    // Small inline LUT: a linear scan is cheapest
+    for (uint16 index = 0; index < img->num_colors; index++)
+    {
+      if (img->LUT[index] == color)
+        return index;
+    }
+    return -1;
+  }
+
+  const uint32 mask = (1u << img->lut_hash_bits) - 1;
+  uint32 slot = LUTHashSlot(img, color);
+  while (img->lut_hash[slot] != 0)
   {
+    int index = img->lut_hash[slot] - 1;
     if (img->LUT[index] == color)
       return index;
+    slot = (slot + 1) & mask;
   }
   return -1;
 }
@@ -186,9 +794,7 @@ static int LUTAllocColor(Image img, rgb_t color)
   int index = LUTFindColor(img, color);
   if (index < 0)
   {
-    check(img->num_colors < FIXED_LUT_SIZE, "LUT Overflow");
-    index = img->num_colors++;
-    img->LUT[index] = color;
+    index = LUTAppendColor(img, color);
   }
   return index;
 }
@@ -215,11 +821,8 @@ Image ImageCreate(uint32 width, uint32 height)
   // Just two possible pixel colors
   Image img = AllocateImageHeader(width, height);
 
-  // Creating the image rows
-  for (uint32 v = 0; v < height; v++)
-  {
-    img->image[v] = AllocateRowArray(width); // Alloc all WHITE row
-  }
+  // Creating the (all WHITE) pixel block
+  AllocatePixels(img);
 
   return img;
 }
@@ -239,23 +842,34 @@ Image ImageCreateChess(uint32 width, uint32 height, uint32 edge, rgb_t color)
   assert(height > 0);
   assert(edge > 0);
 
-  Image img = ImageCreate(width, height);
+  Image img = AllocateImageHeader(width, height);
 
-  // Alloc color in LUT.
+  // Alloc color in LUT (before the pixels, to get the final depth)
   uint8 label = LUTAllocColor(img, color);
+  AllocatePixels(img);
 
   // Assigning the color to each image pixel
 
   // Pixel (0, 0) gets the chosen color label
+  // Rows of the same band of squares are equal: build the first one
+  // and copy it to the others.
+  uint16 *labels = AllocateLabelRow(img);
   for (uint32 v = 0; v < height; v++)
   {
     uint32 I = v / edge;
+    if (v % edge != 0)
+    {
+      memcpy(ImageRowBytes(img, v), ImageRowBytes(img, v - 1), img->stride);
+      continue;
+    }
     for (uint32 u = 0; u < width; u++)
     {
       uint32 J = u / edge;
-      img->image[v][u] = (I + J) % 2 ? 0 : label;
+      labels[u] = (I + J) % 2 ? 0 : label;
     }
+    ImageStoreRowLabels(img, v, labels);
   }
+  free(labels);
 
   // Return the created chess image
   return img;
@@ -268,15 +882,17 @@ Image ImageCreatePalete(uint32 width, uint32 height, uint32 edge)
   assert(height > 0);
   assert(edge > 0);
 
-  Image img = ImageCreate(width, height);
+  Image img = AllocateImageHeader(width, height);
 
   // Fill LUT with generated colors
+  LUTReserve(img, PALETE_SIZE);
   rgb_t color = 0x000000;
-  while (img->num_colors < FIXED_LUT_SIZE)
+  while (img->num_colors < PALETE_SIZE)
   {
     color = GenerateNextColor(color);
-    img->LUT[img->num_colors++] = color;
+    LUTAppendColor(img, color);
   }
+  AllocatePixels(img);
 
   // number of tiles
   uint32 wtiles = width / edge;
@@ -285,10 +901,11 @@ Image ImageCreatePalete(uint32 width, uint32 height, uint32 edge)
   for (uint32 v = 0; v < height; v++)
   {
     uint32 I = v / edge;
+    uint16 *row = ImageRow(img, v);
     for (uint32 u = 0; u < width; u++)
     {
       uint32 J = u / edge;
-      img->image[v][u] = (I * wtiles + J) % FIXED_LUT_SIZE;
+      row[u] = (I * wtiles + J) % PALETE_SIZE;
     }
   }
 
@@ -305,13 +922,16 @@ void ImageDestroy(Image *imgp)
   assert(imgp != NULL);
 
   Image img = *imgp;
-
-  for (uint32 v = 0; v < img->height; v++)
-  {
-    free(img->image[v]);
-  }
-  free(img->image);
-  free(img->LUT);
+  if (img == NULL)
+    return;
+  assert(img->views == 0); // views must not outlive their base
+  if (img->base != NULL)
+    img->base->views--;
+
+  free(img->pixmem);
+  if (img->LUT != img->lut_inline)
+    free(img->LUT);
+  free(img->lut_hash);
   free(img);
 
   *imgp = NULL;
@@ -325,24 +945,27 @@ void ImageDestroy(Image *imgp)
 Image ImageCopy(const Image img)
 {
   assert(img != NULL);
+  if (img->base != NULL)
+    return ImageMaterialize(img);
 
-  Image new_image = ImageCreate(img->width, img->height);
+  Image new_image = AllocateImageHeader(img->width, img->height);
   if (new_image == NULL)
     return NULL;
 
-  for (uint32 v = 0; v < img->height; v++)
-  {
-    for (uint32 u = 0; u < img->width; u++)
-    {
-      new_image->image[v][u] = img->image[v][u];
-    }
-  }
-
+  LUTReserve(new_image, img->num_colors);
   for (uint16 i = 0; i < img->num_colors; i++)
   {
     LUTAllocColor(new_image, img->LUT[i]);
   }
 
+  // Same dimensions and LUT imply same depth and stride:
+  // copy the whole block at once
+  AllocatePixels(new_image);
+  assert(new_image->depth == img->depth);
+  memcpy(new_image->pixels, img->pixels, ImagePixelBytes(img));
+  new_image->fingerprint = img->fingerprint;
+  new_image->has_fingerprint = img->has_fingerprint;
+
   return new_image;
 }
 
@@ -353,26 +976,30 @@ Image ImageCopy(const Image img)
 /// Output the raw RGB image (i.e., print the integer value of pixel).
 void ImageRAWPrint(const Image img)
 {
+  const Image lut_img = ImageBase(img);
   printf("width = %d height = %d\n", (int)img->width, (int)img->height);
-  printf("num_colors = %d\n", (int)img->num_colors);
+  printf("num_colors = %d\n", (int)lut_img->num_colors);
   printf("RAW image\n");
 
   // Print the pixel labels of each image row
+  uint16 *labels = AllocateLabelRow(img);
   for (uint32 v = 0; v < img->height; v++)
   {
+    const uint16 *row = ImageRowLabels(img, v, labels);
     for (uint32 u = 0; u < img->width; u++)
     {
-      printf("%2d", img->image[v][u]);
+      printf("%2d", row[u]);
     }
     // At current row end
     printf("\n");
   }
+  free(labels);
 
   printf("LUT:\n");
   // Print the LUT (R,G,B) values
-  for (int i = 0; i < (int)img->num_colors; i++)
+  for (int i = 0; i < (int)lut_img->num_colors; i++)
   {
-    rgb_t color = img->LUT[i];
+    rgb_t color = lut_img->LUT[i];
     int r = color >> 16 & 0xff;
     int g = color >> 8 & 0xff;
     int b = color & 0xff;
@@ -382,190 +1009,503 @@ void ImageRAWPrint(const Image img)
   printf("\n");
 }
 
-/// PBM file operations --- For BW images
+/// Buffered Netpbm reader
 
-// See PBM format specification: http://netpbm.sourceforge.net/doc/pbm.html
+// A small tokenizer for Netpbm headers and ASCII rasters.
+// The file is read in big chunks into buf (with stdio buffering
+// disabled), and integers are parsed directly from buf.
+// Whitespace and comments (# until the end of the line) are skipped
+// between tokens, as allowed by the Netpbm specification.
 
-//
-static void unpackBits(int nbytes, const uint8 bytes[], uint8 raw_row[])
-{
-  // bitmask starts at top bit
-  int offset = 0;
-  uint8 mask = 1 << (7 - offset);
-  while (offset < 8)
-  { // or (mask > 0)
-    for (int b = 0; b < nbytes; b++)
-    {
-      raw_row[8 * b + offset] = (bytes[b] & mask) != 0;
-    }
-    mask >>= 1;
-    offset++;
-  }
-}
+#define PNM_BUFFER_SIZE (1 << 20)
 
-static void packBits(int nbytes, uint8 bytes[], const uint8 raw_row[])
+typedef struct
 {
-  // bitmask starts at top bit
-  int offset = 0;
-  uint8 mask = 1 << (7 - offset);
-  while (offset < 8)
-  { // or (mask > 0)
-    for (int b = 0; b < nbytes; b++)
-    {
-      if (offset == 0)
-        bytes[b] = 0;
-      bytes[b] |= raw_row[8 * b + offset] ? mask : 0;
-    }
-    mask >>= 1;
-    offset++;
-  }
-}
-
-// Match and skip 0 or more comment lines in file f.
-// Comments start with a # and continue until the end-of-line, inclusive.
-// Returns the number of comments skipped.
-static int skipComments(FILE *f)
+  FILE *f;    // the file (NULL once the whole input is in buf)
+  uint8 *buf; // the current chunk
+  size_t pos; // next byte of buf to parse
+  size_t len; // number of valid bytes in buf
+  int mapped; // buf is the whole file, mapped in memory
+} PNMReader;
+
+static void PNMReaderOpen(PNMReader *r, const char *filename)
 {
-  char c;
-  int i = 0;
-  while (fscanf(f, "#%*[^\n]%c", &c) == 1 && c == '\n')
-  {
-    i++;
-  }
-  return i;
+  check((r->f = fopen(filename, "rb")) != NULL, "Open failed");
+  // We do our own (bigger) buffering
+  setvbuf(r->f, NULL, _IONBF, 0);
+  r->buf = malloc(PNM_BUFFER_SIZE);
+  // Error handling
+  check(r->buf != NULL, "Alloc failed ->reader buffer");
+  r->pos = r->len = 0;
+  r->mapped = 0;
 }
 
-/// Load a raw PBM file.
-/// Only binary PBM files are accepted.
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-Image ImageLoadPBM(const char *filename)
-{ ///
-  int w, h;
-  char c;
-  FILE *f = NULL;
-  Image img = NULL;
+#if defined(__linux__) || defined(__APPLE__)
 
-  check((f = fopen(filename, "rb")) != NULL, "Open failed");
-  // Parse PBM header
-  check(fscanf(f, "P%c ", &c) == 1 && c == '4', "Invalid file format");
-  skipComments(f);
-  check(fscanf(f, "%d ", &w) == 1 && w >= 0, "Invalid width");
-  skipComments(f);
-  check(fscanf(f, "%d", &h) == 1 && h >= 0, "Invalid height");
-  check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected");
+//
+// GNU/Linux and MacOS: files may be mapped in memory
+//
 
-  // Allocate image
-  img = AllocateImageHeader((uint32)w, (uint32)h);
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-  // Read pixels
-  int nbytes = (w + 8 - 1) / 8; // number of bytes for each row
-  // using VLAs...
-  uint8 bytes[nbytes];
-  uint8 raw_row[nbytes * 8];
-  for (uint32 v = 0; v < img->height; v++)
+// Open filename mapping the whole file in memory (zero-copy).
+// Falls back to PNMReaderOpen for files that cannot be mapped
+// (e.g., pipes, or empty files).
+static void PNMReaderOpenMapped(PNMReader *r, const char *filename)
+{
+  int fd = open(filename, O_RDONLY);
+  check(fd >= 0, "Open failed");
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
   {
-    check(fread(bytes, sizeof(uint8), nbytes, f) == (size_t)nbytes, "Reading pixels");
-    unpackBits(nbytes, bytes, raw_row);
-    img->image[v] = AllocateRowArray((uint32)w);
-    for (uint32 u = 0; u < (uint32)w; u++)
-    {
-      img->image[v][u] = (uint16)raw_row[u];
-    }
+    PNMReaderOpen(r, filename);
+    return;
   }
+  madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+  r->f = NULL;
+  r->buf = map;
+  r->pos = 0;
+  r->len = (size_t)st.st_size;
+  r->mapped = 1;
+}
 
-  fclose(f);
-  return img;
+static void PNMReaderUnmap(PNMReader *r)
+{
+  munmap(r->buf, r->len);
 }
 
-/// Save image to PBM file.
-/// On success, returns nonzero.
-/// On failure, a partial and invalid file may be left in the system.
-int ImageSavePBM(const Image img, const char *filename)
-{ ///
-  assert(img != NULL);
-  assert(img->num_colors == 2);
+#else
 
-  int w = (int)img->width;
-  int h = (int)img->height;
-  FILE *f = NULL;
+//
+// Other systems: files are read through the buffer
+//
 
-  check((f = fopen(filename, "wb")) != NULL, "Open failed");
-  check(fprintf(f, "P4\n%d %d\n", w, h) > 0, "Writing header failed");
+static void PNMReaderOpenMapped(PNMReader *r, const char *filename)
+{
+  PNMReaderOpen(r, filename);
+}
 
-  // Write pixels
-  int nbytes = (w + 8 - 1) / 8; // number of bytes for each row
-  // using VLAs...
-  uint8 bytes[nbytes];
-  uint8 raw_row[nbytes * 8];
-  for (uint32 v = 0; v < img->height; v++)
-  {
-    for (uint32 u = 0; u < img->width; u++)
-    {
-      raw_row[u] = (uint8)img->image[v][u];
-    }
-    // Fill padding pixels with WHITE
-    memset(raw_row + w, WHITE, nbytes * 8 - w);
-    packBits(nbytes, bytes, raw_row);
-    check(fwrite(bytes, sizeof(uint8), nbytes, f) == (size_t)nbytes, "Writing pixels failed");
-  }
+static void PNMReaderUnmap(PNMReader *r)
+{
+  (void)r;
+  assert(0); // never mapped
+}
 
-  // Cleanup
-  fclose(f);
+#endif
 
-  return 1;
+static void PNMReaderClose(PNMReader *r)
+{
+  if (r->f != NULL)
+    fclose(r->f);
+  if (r->mapped)
+    PNMReaderUnmap(r);
+  else
+    free(r->buf);
 }
 
-/// PPM file operations --- For RGB images
-
-/// Load a raw PPM file.
-/// Only ASCII PPM files are accepted.
-/// On success, a new image is returned.
+// Read the next chunk. Returns 0 at end of file.
+static int PNMFill(PNMReader *r)
+{
+  if (r->f == NULL)
+    return 0;
+  r->len = fread(r->buf, 1, PNM_BUFFER_SIZE, r->f);
+  r->pos = 0;
+  check(!ferror(r->f), "Reading failed");
+  return r->len > 0;
+}
+
+// Next byte, or EOF.
+static inline int PNMGet(PNMReader *r)
+{
+  if (r->pos == r->len && !PNMFill(r))
+    return EOF;
+  return r->buf[r->pos++];
+}
+
+// Next byte, without consuming it, or EOF.
+static inline int PNMPeek(PNMReader *r)
+{
+  if (r->pos == r->len && !PNMFill(r))
+    return EOF;
+  return r->buf[r->pos];
+}
+
+static inline int PNMIsSpace(int c)
+{
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Skip whitespace and comments.
+static void PNMSkipSpace(PNMReader *r)
+{
+  for (;;)
+  {
+    int c = PNMPeek(r);
+    if (PNMIsSpace(c))
+    {
+      r->pos++;
+    }
+    else if (c == '#')
+    {
+      while ((c = PNMGet(r)) != EOF && c != '\n' && c != '\r')
+        ;
+    }
+    else
+    {
+      return;
+    }
+  }
+}
+
+// Parse a non-negative decimal integer, after skipping whitespace and
+// comments. Values too large for an int are clamped to INT_MAX.
+// Returns 1 on success, 0 if no digits were found.
+static int PNMReadIntSlow(PNMReader *r, int *value)
+{
+  PNMSkipSpace(r);
+  int c = PNMPeek(r);
+  if (c < '0' || c > '9')
+    return 0;
+  long n = 0;
+  while ((c = PNMPeek(r)) >= '0' && c <= '9')
+  {
+    if (n <= INT_MAX)
+      n = 10 * n + (c - '0');
+    r->pos++;
+  }
+  *value = n <= INT_MAX ? (int)n : INT_MAX;
+  return 1;
+}
+
+// Same as PNMReadIntSlow.
+// Fast path for the usual case of a short token (no comments, at most
+// 3 digits) well inside the buffer: no refills, no bounds checks.
+static inline int PNMReadInt(PNMReader *r, int *value)
+{
+  if (r->len - r->pos >= 16)
+  {
+    const uint8 *p = r->buf + r->pos;
+    const uint8 *end = r->buf + r->len - 4; // room for 3 digits + 1
+    while (p < end && (*p == ' ' || *p == '\n'))
+      p++;
+    if (p < end && (unsigned)(*p - '0') < 10)
+    {
+      int n = *p++ - '0';
+      if ((unsigned)(*p - '0') < 10)
+      {
+        n = 10 * n + (*p++ - '0');
+        if ((unsigned)(*p - '0') < 10)
+          n = 10 * n + (*p++ - '0');
+      }
+      if ((unsigned)(*p - '0') >= 10)
+      {
+        r->pos = (size_t)(p - r->buf);
+        *value = n;
+        return 1;
+      }
+    }
+  }
+  return PNMReadIntSlow(r, value);
+}
+
+// Copy the next n bytes to dst. Returns 1 on success, 0 at end of file.
+// Large reads go straight from the file to dst.
+static int PNMReadBytes(PNMReader *r, uint8 *dst, size_t n)
+{
+  size_t avail = r->len - r->pos;
+  if (avail >= n)
+  {
+    memcpy(dst, r->buf + r->pos, n);
+    r->pos += n;
+    return 1;
+  }
+  memcpy(dst, r->buf + r->pos, avail);
+  r->pos = r->len;
+  dst += avail;
+  n -= avail;
+  if (n >= PNM_BUFFER_SIZE / 2)
+  {
+    if (r->f == NULL || fread(dst, 1, n, r->f) != n)
+      return 0;
+    return 1;
+  }
+  while (n > 0)
+  {
+    if (!PNMFill(r))
+      return 0;
+    size_t chunk = r->len < n ? r->len : n;
+    memcpy(dst, r->buf, chunk);
+    r->pos = chunk;
+    dst += chunk;
+    n -= chunk;
+  }
+  return 1;
+}
+
+/// Buffered Netpbm writer
+
+// Output is assembled in a big buffer and written with a few big fwrites.
+
+typedef struct
+{
+  FILE *f;
+  uint8 *buf;
+  size_t len; // number of bytes in buf
+} PNMWriter;
+
+static void PNMWriterOpen(PNMWriter *w, const char *filename)
+{
+  check((w->f = fopen(filename, "wb")) != NULL, "Open failed");
+  setvbuf(w->f, NULL, _IONBF, 0);
+  w->buf = malloc(PNM_BUFFER_SIZE);
+  // Error handling
+  check(w->buf != NULL, "Alloc failed ->writer buffer");
+  w->len = 0;
+}
+
+static void PNMFlush(PNMWriter *w)
+{
+  check(fwrite(w->buf, 1, w->len, w->f) == w->len, "Writing pixels failed");
+  w->len = 0;
+}
+
+// Room for n (<= PNM_BUFFER_SIZE) more bytes at the end of buf.
+// Returns where to write them (the caller must then add n to len).
+static inline uint8 *PNMReserve(PNMWriter *w, size_t n)
+{
+  if (w->len + n > PNM_BUFFER_SIZE)
+    PNMFlush(w);
+  return w->buf + w->len;
+}
+
+// Formatted output of a (short) header line.
+static void PNMPrintf(PNMWriter *w, const char *format, ...)
+{
+  char text[128];
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(text, sizeof(text), format, args);
+  va_end(args);
+  check(n > 0 && (size_t)n < sizeof(text), "Writing header failed");
+  memcpy(PNMReserve(w, (size_t)n), text, (size_t)n);
+  w->len += (size_t)n;
+}
+
+static void PNMWriterClose(PNMWriter *w)
+{
+  PNMFlush(w);
+  free(w->buf);
+  check(fclose(w->f) == 0, "Closing file failed");
+}
+
+/// PBM file operations --- For BW images
+
+// See PBM format specification: http://netpbm.sourceforge.net/doc/pbm.html
+
+/// Load a raw PBM file.
+/// Only binary PBM files are accepted.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageLoadPBM(const char *filename)
+{ ///
+  int w, h;
+  PNMReader reader;
+  PNMReader *r = &reader;
+  Image img = NULL;
+
+  PNMReaderOpenMapped(r, filename);
+  // Parse PBM header
+  check(PNMGet(r) == 'P' && PNMGet(r) == '4', "Invalid file format");
+  check(PNMReadInt(r, &w) && w > 0, "Invalid width");
+  check(PNMReadInt(r, &h) && h > 0, "Invalid height");
+  check(PNMIsSpace(PNMGet(r)), "Whitespace expected");
+
+  // Allocate image (2 colors: 1-bit rows, in the PBM layout)
+  img = ImageCreate((uint32)w, (uint32)h);
+  assert(img->depth == 1);
+
+  // Read pixels: the packed rows are copied as they are
+  size_t nbytes = ((size_t)w + 8 - 1) / 8; // number of bytes for each row
+  if (r->mapped)
+    check(r->len - r->pos >= nbytes * img->height, "Reading pixels");
+  // The padding bits of the last byte of each row (if any) are cleared
+  uint32 pad_bits = (uint32)(8 * nbytes - (size_t)w);
+  uint8 last_mask = (uint8)(0xff << pad_bits);
+  for (uint32 v = 0; v < img->height; v++)
+  {
+    uint8 *row = ImageRowBytes(img, v);
+    if (r->mapped)
+    {
+      memcpy(row, r->buf + r->pos, nbytes);
+      r->pos += nbytes;
+    }
+    else
+    {
+      check(PNMReadBytes(r, row, nbytes), "Reading pixels");
+    }
+    if (pad_bits != 0)
+      row[nbytes - 1] &= last_mask;
+  }
+
+  PNMReaderClose(r);
+  return img;
+}
+
+/// Save image to PBM file.
+/// On success, returns nonzero.
+/// On failure, a partial and invalid file may be left in the system.
+int ImageSavePBM(const Image img, const char *filename)
+{ ///
+  assert(img != NULL);
+  assert(ImageBase(img)->num_colors == 2);
+
+  int w = (int)img->width;
+  int h = (int)img->height;
+  PNMWriter writer;
+
+  PNMWriterOpen(&writer, filename);
+  PNMPrintf(&writer, "P4\n%d %d\n", w, h);
+
+  // Write pixels: 2-color images already have rows in the PBM layout
+  // (in pieces of at most BYTES_PER_PIECE bytes, to fit the buffer)
+  // Padding pixels are WHITE, so the padding bits are 0.
+  // Rows of a view are gathered as labels, and packed again.
+  assert(ImageBase(img)->depth == 1);
+  const uint32 BYTES_PER_PIECE = 1 << 16;
+  uint32 nbytes = (img->width + 8 - 1) / 8; // number of bytes for each row
+  RowReader reader = {0};
+  uint8 *packed = NULL;
+  if (img->base != NULL)
+  {
+    pthread_once(&BitTablesOnce, InitBitTables);
+    RowReaderInit(&reader, img);
+    packed = malloc(nbytes);
+    // Error handling
+    check(packed != NULL, "Alloc failed ->packed row");
+  }
+  for (uint32 v = 0; v < img->height; v++)
+  {
+    const uint8 *row;
+    if (img->base != NULL)
+    {
+      packLabelsToBits(0, nbytes, RowReaderRow(&reader, v), packed);
+      row = packed;
+    }
+    else
+      row = ImageRowBytes(img, v);
+    for (uint32 b0 = 0; b0 < nbytes; b0 += BYTES_PER_PIECE)
+    {
+      uint32 n = nbytes - b0 < BYTES_PER_PIECE ? nbytes - b0 : BYTES_PER_PIECE;
+      memcpy(PNMReserve(&writer, n), row + b0, n);
+      writer.len += n;
+    }
+  }
+
+  // Cleanup
+  RowReaderFree(&reader);
+  free(packed);
+  PNMWriterClose(&writer);
+
+  return 1;
+}
+
+/// PPM file operations --- For RGB images
+
+/// Load a PPM file.
+/// Both ASCII (P3) and binary (P6) PPM files are accepted.
+/// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 Image ImageLoadPPM(const char *filename)
 {
   assert(filename != NULL);
   int w, h;
   int levels;
-  char c;
-  FILE *f = NULL;
+  PNMReader reader;
+  PNMReader *r = &reader;
 
-  check((f = fopen(filename, "rb")) != NULL, "Open failed");
+  PNMReaderOpen(r, filename);
   // Parse PPM header
-  check(fscanf(f, "P%c ", &c) == 1 && c == '3', "Invalid file format");
-  skipComments(f);
-  check(fscanf(f, "%d ", &w) == 1 && w >= 0, "Invalid width");
-  skipComments(f);
-  check(fscanf(f, "%d", &h) == 1 && h >= 0, "Invalid height");
-  skipComments(f);
-  check(fscanf(f, "%d", &levels) == 1 && 0 <= levels && levels <= 255, "Invalid depth");
-  check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected");
+  check(PNMGet(r) == 'P', "Invalid file format");
+  int format = PNMGet(r);
+  check(format == '3' || format == '6', "Invalid file format");
+  check(PNMReadInt(r, &w) && w > 0, "Invalid width");
+  check(PNMReadInt(r, &h) && h > 0, "Invalid height");
+  check(PNMReadInt(r, &levels) && 0 <= levels && levels <= 255, "Invalid depth");
+  check(PNMIsSpace(PNMGet(r)), "Whitespace expected");
 
   // Allocate image
   Image img = ImageCreate((uint32)w, (uint32)h);
 
   // Read pixels
-  for (uint32 v = 0; v < img->height; v++)
+  // Neighbouring pixels usually have the same color: remember the last one
+  // (starting with a value that is not a valid color)
+  // Each row is decoded into labels, and then stored in the image
+  // (with the depth of the colors found so far)
+  rgb_t last_color = 0xffffffff;
+  uint16 last_index = WHITE;
+  uint16 *row = AllocateLabelRow(img);
+  if (format == '6')
   {
-    for (uint32 u = 0; u < img->width; u++)
+    // Binary raster: 3 bytes per pixel, read a whole row at a time
+    uint8 *bytes = malloc(3 * (size_t)w + 1);
+    // Error handling
+    check(bytes != NULL, "Alloc failed ->row buffer");
+    for (uint32 v = 0; v < img->height; v++)
+    {
+      check(PNMReadBytes(r, bytes, 3 * (size_t)w), "Reading pixels");
+      const uint8 *p = bytes;
+      for (uint32 u = 0; u < img->width; u++, p += 3)
+      {
+        rgb_t color = (rgb_t)p[0] << 16 | (rgb_t)p[1] << 8 | p[2];
+        if (color != last_color)
+        {
+          check(p[0] <= levels && p[1] <= levels && p[2] <= levels, "Invalid pixel color");
+          last_color = color;
+          last_index = LUTAllocColor(img, color);
+        }
+        row[u] = last_index;
+      }
+      ImageStoreRowLabels(img, v, row);
+    }
+    free(bytes);
+  }
+  else
+  {
+    for (uint32 v = 0; v < img->height; v++)
     {
-      int r, g, b;
-      check(fscanf(f, "%d %d %d", &r, &g, &b) == 3 && 0 <= r && r <= levels &&
-                0 <= g && g <= levels && 0 <= b && b <= levels,
-            "Invalid pixel color");
-      rgb_t color = r << 16 | g << 8 | b;
-      uint16 index = LUTAllocColor(img, color);
-      img->image[v][u] = index;
-      // printf("[%u][%u]: (%d,%d,%d) -> %u (%6x)\n", v, u, r,g,b, index,
-      // color);
+      for (uint32 u = 0; u < img->width; u++)
+      {
+        int red, green, blue;
+        check(PNMReadInt(r, &red) && PNMReadInt(r, &green) && PNMReadInt(r, &blue) &&
+                  red <= levels && green <= levels && blue <= levels,
+              "Invalid pixel color");
+        rgb_t color = red << 16 | green << 8 | blue;
+        if (color != last_color)
+        {
+          last_color = color;
+          last_index = LUTAllocColor(img, color);
+        }
+        row[u] = last_index;
+      }
+      ImageStoreRowLabels(img, v, row);
     }
-    fprintf(f, "\n");
   }
 
-  fclose(f);
+  free(row);
+  PNMReaderClose(r);
   return img;
 }
 
+// Every pixel of an ASCII PPM file is written as "  %3d %3d %3d"
+#define PPM_PIXEL_CHARS 13
+
 /// Save image to PPM file.
 /// On success, returns nonzero.
 /// On failure, a partial and invalid file may be left in the system.
@@ -575,28 +1515,105 @@ int ImageSavePPM(const Image img, const char *filename)
 
   int w = (int)img->width;
   int h = (int)img->height;
-  FILE *f = NULL;
+  PNMWriter writer;
+
+  PNMWriterOpen(&writer, filename);
+  PNMPrintf(&writer, "P3\n%d %d\n255\n", w, h);
 
-  check((f = fopen(filename, "wb")) != NULL, "Open failed");
-  check(fprintf(f, "P3\n%d %d\n255\n", w, h) > 0, "Writing header failed");
+  // Render the text of each LUT color once
+  const Image lut_img = ImageBase(img);
+  char *text = malloc((size_t)lut_img->num_colors * PPM_PIXEL_CHARS);
+  // Error handling
+  check(text != NULL, "Alloc failed ->color text");
+  for (uint32 i = 0; i < lut_img->num_colors; i++)
+  {
+    char pixel[PPM_PIXEL_CHARS + 1];
+    rgb_t color = lut_img->LUT[i];
+    snprintf(pixel, sizeof(pixel), "  %3d %3d %3d",
+             (int)(color >> 16 & 0xff), (int)(color >> 8 & 0xff), (int)(color & 0xff));
+    memcpy(text + (size_t)i * PPM_PIXEL_CHARS, pixel, PPM_PIXEL_CHARS);
+  }
 
-  // The pixel RGB values
+  // The pixel RGB values: copy the text of each pixel color
+  // (in pieces of at most PIXELS_PER_PIECE pixels, to fit the buffer)
+  const uint32 PIXELS_PER_PIECE = 4096;
+  RowReader reader;
+  RowReaderInit(&reader, img);
   for (uint32 v = 0; v < img->height; v++)
   {
-    for (uint32 u = 0; u < img->width; u++)
+    const uint16 *row = RowReaderRow(&reader, v);
+    for (uint32 u0 = 0; u0 < img->width; u0 += PIXELS_PER_PIECE)
+    {
+      uint32 u1 = img->width - u0 < PIXELS_PER_PIECE ? img->width : u0 + PIXELS_PER_PIECE;
+      uint8 *p = PNMReserve(&writer, (size_t)(u1 - u0) * PPM_PIXEL_CHARS);
+      for (uint32 u = u0; u < u1; u++, p += PPM_PIXEL_CHARS)
+      {
+        memcpy(p, text + (size_t)row[u] * PPM_PIXEL_CHARS, PPM_PIXEL_CHARS);
+      }
+      writer.len += (size_t)(u1 - u0) * PPM_PIXEL_CHARS;
+    }
+    *PNMReserve(&writer, 1) = '\n';
+    writer.len++;
+  }
+
+  // Cleanup
+  RowReaderFree(&reader);
+  free(text);
+  PNMWriterClose(&writer);
+
+  return 1;
+}
+
+/// Save image to a binary (P6) PPM file.
+/// On success, returns nonzero.
+/// On failure, a partial and invalid file may be left in the system.
+int ImageSavePPMBinary(const Image img, const char *filename)
+{
+  assert(img != NULL);
+
+  int w = (int)img->width;
+  int h = (int)img->height;
+  PNMWriter writer;
+
+  PNMWriterOpen(&writer, filename);
+  PNMPrintf(&writer, "P6\n%d %d\n255\n", w, h);
+
+  // The 3 bytes of each LUT color
+  const Image lut_img = ImageBase(img);
+  uint8 *rgb = malloc(3 * (size_t)lut_img->num_colors);
+  // Error handling
+  check(rgb != NULL, "Alloc failed ->color bytes");
+  for (uint32 i = 0; i < lut_img->num_colors; i++)
+  {
+    rgb[3 * i] = lut_img->LUT[i] >> 16 & 0xff;
+    rgb[3 * i + 1] = lut_img->LUT[i] >> 8 & 0xff;
+    rgb[3 * i + 2] = lut_img->LUT[i] & 0xff;
+  }
+
+  // The pixel RGB values: copy the bytes of each pixel color
+  // (in pieces of at most PIXELS_PER_PIECE pixels, to fit the buffer)
+  const uint32 PIXELS_PER_PIECE = 4096;
+  RowReader reader;
+  RowReaderInit(&reader, img);
+  for (uint32 v = 0; v < img->height; v++)
+  {
+    const uint16 *row = RowReaderRow(&reader, v);
+    for (uint32 u0 = 0; u0 < img->width; u0 += PIXELS_PER_PIECE)
     {
-      uint16 index = img->image[v][u];
-      rgb_t color = img->LUT[index];
-      int r = color >> 16 & 0xff;
-      int g = color >> 8 & 0xff;
-      int b = color & 0xff;
-      fprintf(f, "  %3d %3d %3d", r, g, b);
+      uint32 u1 = img->width - u0 < PIXELS_PER_PIECE ? img->width : u0 + PIXELS_PER_PIECE;
+      uint8 *p = PNMReserve(&writer, 3 * (size_t)(u1 - u0));
+      for (uint32 u = u0; u < u1; u++, p += 3)
+      {
+        memcpy(p, rgb + 3 * (size_t)row[u], 3);
+      }
+      writer.len += 3 * (size_t)(u1 - u0);
     }
-    fprintf(f, "\n");
   }
 
   // Cleanup
-  fclose(f);
+  RowReaderFree(&reader);
+  free(rgb);
+  PNMWriterClose(&writer);
 
   return 1;
 }
@@ -623,16 +1640,142 @@ uint32 ImageHeight(const Image img)
 uint16 ImageColors(const Image img)
 {
   assert(img != NULL);
-  return img->num_colors;
+  return ImageBase(img)->num_colors;
 }
 
 /// Image comparison
 
 /// These functions do not modify the images and never fail.
 
+// Hash of a color (the splitmix64 finalizer).
+static inline uint64_t ColorHash(rgb_t color)
+{
+  uint64_t x = color + 0x9E3779B97F4A7C15ull;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+  return x ^ (x >> 31);
+}
+
+// Multipliers of the fingerprint polynomials (odd, so invertible)
+#define FINGERPRINT_GROUP 0x9E3779B97F4A7C15ull
+#define FINGERPRINT_ROW 0xC2B2AE3D27D4EB4Full
+
+// Hash of 8 consecutive pixels, given the hashes of their colors:
+// the hash of pixel j is rotated by 8*j bits.
+static inline uint64_t GroupHash(uint64_t h0, uint64_t h1, uint64_t h2, uint64_t h3,
+                                 uint64_t h4, uint64_t h5, uint64_t h6, uint64_t h7)
+{
+#define ROTL(x, r) ((x) << (r) | (x) >> (64 - (r)))
+  return h0 ^ ROTL(h1, 8) ^ ROTL(h2, 16) ^ ROTL(h3, 24) ^
+         ROTL(h4, 32) ^ ROTL(h5, 40) ^ ROTL(h6, 48) ^ ROTL(h7, 56);
+#undef ROTL
+}
+
+// Fingerprint of the contents of img, computed if not up to date.
+// (ImageIsEqual only reads fingerprints that are up to date, so that
+// it never writes to its arguments, and a one-off comparison does not
+// pay for hashing both images.)
+// Each row is split in groups of 8 pixels (the padding pixels are WHITE
+// in every depth), hashed with GroupHash from the ColorHash of each
+// pixel; the groups of a row, and then the rows, are combined as
+// polynomials in GROUP and ROW. Only colors and positions count, so
+// equal images have equal fingerprints whatever their labels and depths.
+uint64_t ImageFingerprint(Image img)
+{
+  assert(img != NULL);
+  assert(img->base == NULL); // see ImageMaterialize
+  if (img->has_fingerprint)
+    return img->fingerprint;
+
+  // Hash of each label, and (for 1-bit rows) of each byte of 8 pixels
+  uint64_t *label_hash = malloc(img->num_colors * sizeof(uint64_t));
+  // Error handling
+  check(label_hash != NULL, "Alloc failed ->label hashes");
+  for (uint32 label = 0; label < img->num_colors; label++)
+    label_hash[label] = ColorHash(img->LUT[label]);
+  uint64_t byte_hash[256];
+  if (img->depth == 1)
+  {
+    const uint64_t *h = label_hash;
+    for (int byte = 0; byte < 256; byte++)
+    {
+      byte_hash[byte] = GroupHash(h[byte >> 7 & 1], h[byte >> 6 & 1], h[byte >> 5 & 1], h[byte >> 4 & 1],
+                                  h[byte >> 3 & 1], h[byte >> 2 & 1], h[byte >> 1 & 1], h[byte & 1]);
+    }
+  }
+
+  // Horner's rule, from the last group of each row to the first
+  uint32 groups = (img->width + 8 - 1) / 8;
+  uint64_t hash = (uint64_t)img->width << 32 | img->height;
+  for (uint32 v = 0; v < img->height; v++)
+  {
+    uint64_t row_hash = 0;
+    if (img->depth == 1)
+    {
+      const uint8 *row = ImageRowBytes(img, v);
+      for (uint32 b = groups; b-- > 0;)
+        row_hash = row_hash * FINGERPRINT_GROUP + byte_hash[row[b]];
+    }
+    else if (img->depth == 8)
+    {
+      const uint8 *row = ImageRow8(img, v);
+      for (uint32 b = groups; b-- > 0;)
+      {
+        const uint8 *p = row + 8 * b;
+        const uint64_t *h = label_hash;
+        row_hash = row_hash * FINGERPRINT_GROUP +
+                   GroupHash(h[p[0]], h[p[1]], h[p[2]], h[p[3]], h[p[4]], h[p[5]], h[p[6]], h[p[7]]);
+      }
+    }
+    else
+    {
+      const uint16 *row = ImageRow(img, v);
+      for (uint32 b = groups; b-- > 0;)
+      {
+        const uint16 *p = row + 8 * b;
+        const uint64_t *h = label_hash;
+        row_hash = row_hash * FINGERPRINT_GROUP +
+                   GroupHash(h[p[0]], h[p[1]], h[p[2]], h[p[3]], h[p[4]], h[p[5]], h[p[6]], h[p[7]]);
+      }
+    }
+    hash = hash * FINGERPRINT_ROW + row_hash;
+  }
+  free(label_hash);
+  COUNT(PIXREADS, (unsigned long)img->width * img->height);
+
+  img->fingerprint = hash;
+  img->has_fingerprint = 1;
+  return hash;
+}
+
+// Translate the labels of img1 to the labels of img2 with the same colors:
+// map[label1] = label2, or LUT_MAX_COLORS (not a valid label) if img2
+// has no such color.
+// Returns 1 if the translation is the identity.
+static int LUTTranslation(const Image img1, const Image img2, uint16 map[])
+{
+  int identity = 1;
+  for (uint32 label = 0; label < img1->num_colors; label++)
+  {
+    int index = LUTFindColor(img2, img1->LUT[label]);
+    map[label] = index < 0 ? LUT_MAX_COLORS : (uint16)index;
+    identity = identity && index == (int)label;
+  }
+  COUNT(LUTREADS, 2 * (unsigned long)img1->num_colors);
+  return identity;
+}
+
 /// Check if img1 and img2 represent equal images.
 /// NOTE: The same rgb color may correspond to different LUT labels in
 /// different images!
+/// Images that both have fingerprints (see ImageFingerprint) are
+/// rejected at once if these differ; fingerprints are not computed here.
+/// Otherwise, the LUT of img1 is translated to the labels of img2.
+/// When the translation is the identity (e.g., after ImageCopy), rows with
+/// the same depth are compared with memcmp; otherwise (or if memcmp finds
+/// a difference) pixels are compared through the translation.
+/// Views are compared row by row, as gathered from their bases (with no
+/// fingerprint: it depends on the orientation).
 int ImageIsEqual(const Image img1, const Image img2)
 {
   assert(img1 != NULL);
@@ -644,20 +1787,72 @@ int ImageIsEqual(const Image img1, const Image img2)
     return 0;
   if (img1->width != img2->width)
     return 0;
+  int views = img1->base != NULL || img2->base != NULL;
+  if (!views && img1->has_fingerprint && img2->has_fingerprint &&
+      img1->fingerprint != img2->fingerprint)
+    return 0;
+
+  const Image lut1 = ImageBase(img1);
+  const Image lut2 = ImageBase(img2);
+  uint16 *map = malloc(lut1->num_colors * sizeof(uint16));
+  // Error handling
+  check(map != NULL, "Alloc failed ->label map");
+  // Equal widths and depths imply equal strides, and padding is WHITE
+  int identity = LUTTranslation(lut1, lut2, map);
+  int same_rows = identity && !views && img1->depth == img2->depth;
+
+  uint32 h = 0;
+  if (same_rows)
+  {
+    while (h < img1->height && memcmp(ImageRowBytes(img1, h), ImageRowBytes(img2, h), img1->stride) == 0)
+    {
+      // Count memory accesses: two image index reads per pixel
+      COUNT(PIXREADS, 2 * (unsigned long)img1->width);
+      COUNT(PIXVALIDATIONS, img1->width);
+      h++;
+    }
+    if (h == img1->height)
+    {
+      free(map);
+      return 1;
+    }
+  }
 
-  for (uint32 h = 0; h < img1->height; h++)
+  // Rows in different depths or orientations, or rows that memcmp found
+  // different (a LUT may repeat a color): compare the labels of the rows
+  RowReader reader1, reader2;
+  RowReaderInit(&reader1, img1);
+  RowReaderInit(&reader2, img2);
+  int equal = 1;
+  for (; h < img1->height && equal; h++)
   {
+    const uint16 *row1 = RowReaderRow(&reader1, h);
+    const uint16 *row2 = RowReaderRow(&reader2, h);
+    if (identity && memcmp(row1, row2, img1->width * sizeof(uint16)) == 0)
+    {
+      // (Same labels, but in different depths or orientations)
+      COUNT(PIXREADS, 2 * (unsigned long)img1->width);
+      COUNT(PIXVALIDATIONS, img1->width);
+      continue;
+    }
     for (uint32 w = 0; w < img1->width; w++)
     {
-      // Count memory accesses: two image index reads + two LUT reads
-      PIXREADS += 2;
-      LUTREADS += 2;
-      PIXVALIDATIONS++;
-      if (img1->LUT[img1->image[h][w]] != img2->LUT[img2->image[h][w]])
-        return 0;
+      // Count memory accesses: two image index reads
+      COUNT(PIXREADS, 2);
+      COUNT(PIXVALIDATIONS, 1);
+      // (A LUT may repeat a color: compare the colors before giving up)
+      if (map[row1[w]] != row2[w] && lut1->LUT[row1[w]] != lut2->LUT[row2[w]])
+      {
+        COUNT(LUTREADS, 2);
+        equal = 0;
+        break;
+      }
     }
   }
-  return 1;
+  RowReaderFree(&reader1);
+  RowReaderFree(&reader2);
+  free(map);
+  return equal;
 }
 
 int ImageIsDifferent(const Image img1, const Image img2)
@@ -676,66 +1871,854 @@ int ImageIsDifferent(const Image img1, const Image img2)
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 
-/// Rotate 90 degrees clockwise (CW).
-/// Returns a rotated version of the image.
-/// Ensures: The original img is not modified.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-Image ImageRotate90CW(const Image img)
+// Transpose an 8x8 bit matrix: byte i (from the most significant) is
+// row i, and bit 7-j of each byte is column j.
+static inline uint64_t transpose8x8(uint64_t x)
 {
-  assert(img != NULL);
-
-  Image new_image = ImageCreate(img->height, img->width);
-  if (new_image == NULL)
-    return NULL;
-
-  for (uint16 lut_index = 0; lut_index < img->num_colors; lut_index++)
-  {
-    LUTAllocColor(new_image, img->LUT[lut_index]);
-  }
+  uint64_t t;
+  t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAull;
+  x = x ^ t ^ (t << 7);
+  t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCull;
+  x = x ^ t ^ (t << 14);
+  t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ull;
+  x = x ^ t ^ (t << 28);
+  return x;
+}
 
-  for (uint32 h = 0; h < new_image->height; h++)
+// Transpose the 1-bit pixels of img into dst, in blocks of 8x8 pixels:
+// 8 bytes of consecutive rows of img become, transposed, the bytes of
+// 8 consecutive rows of dst.
+// Column x of dst is row x of img, or row H-1-x if flip_src is set;
+// row y of dst is column y of img, or column W-1-y if flip_dst is set.
+// So (1, 0) rotates 90 degrees CW, (0, 1) 270 degrees CW and (0, 0)
+// transposes.
+static void transposeBits(const Image img, Image dst, int flip_src, int flip_dst)
+{
+  uint32 src_bytes = (img->width + 8 - 1) / 8;
+  uint32 dst_bytes = (dst->width + 8 - 1) / 8;
+  for (uint32 k = 0; k < dst_bytes; k++)
   {
-    for (uint32 w = 0; w < new_image->width; w++)
+    // Columns 8k..8k+7 of dst; rows beyond img give WHITE padding bits.
+    const uint8 *src[8];
+    uint32 nrows = 0;
+    for (; nrows < 8 && 8 * k + nrows < img->height; nrows++)
     {
-      new_image->image[h][w] = img->image[(img->height - 1) - w][h];
+      uint32 x = 8 * k + nrows;
+      src[nrows] = ImageRowBytes(img, flip_src ? img->height - 1 - x : x);
+    }
+    for (uint32 b = 0; b < src_bytes; b++)
+    {
+      uint64_t x = 0;
+      for (uint32 i = 0; i < nrows; i++)
+        x |= (uint64_t)src[i][b] << (56 - 8 * i);
+      x = transpose8x8(x);
+      // Columns 8b..8b+7 of img; their padding bits are dropped
+      for (uint32 j = 0; j < 8 && 8 * b + j < img->width; j++)
+      {
+        uint32 y = 8 * b + j;
+        ImageRowBytes(dst, flip_dst ? dst->height - 1 - y : y)[k] =
+            (uint8)(x >> (56 - 8 * j));
+      }
     }
   }
-
-  return new_image;
 }
 
-/// Rotate 180 degrees clockwise (CW).
-/// Returns a rotated version of the image.
-/// Ensures: The original img is not modified.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-Image ImageRotate180CW(const Image img)
+// Rotations and transposition of 8- and 16-bit labels all reduce to a
+// transposition, with the source or the destination rows walked
+// backwards (a negative row step).  Reading a column of a large image
+// touches a new cache line (and often a new page) for every pixel, so
+// the transposition is done in TRANSPOSE_TILE x TRANSPOSE_TILE tiles
+// that stay in cache, each transposed as 8x8 blocks in SSE2 registers.
+#define TRANSPOSE_TILE 64
+
+#if defined(__SSE2__)
+// dst[j*dst_step + i] = src[i*src_step + j], for i, j < 8.
+static inline void transpose8x8Labels16(const uint16 *src, ptrdiff_t src_step,
+                                        uint16 *dst, ptrdiff_t dst_step)
 {
-  assert(img != NULL);
-
-  Image new_image = ImageCreate(img->width, img->height);
-  if (new_image == NULL)
-    return NULL;
-
-  for (uint16 lut_index = 0; lut_index < img->num_colors; lut_index++)
+  __m128i r[8], a[8], b[8];
+  for (int i = 0; i < 8; i++)
+    r[i] = _mm_loadu_si128((const __m128i *)(src + i * src_step));
+  for (int i = 0; i < 4; i++)
   {
-    LUTAllocColor(new_image, img->LUT[lut_index]);
+    // a[2i] = columns 0..3 and a[2i+1] = columns 4..7 of rows 2i, 2i+1
+    a[2 * i] = _mm_unpacklo_epi16(r[2 * i], r[2 * i + 1]);
+    a[2 * i + 1] = _mm_unpackhi_epi16(r[2 * i], r[2 * i + 1]);
   }
-
-  for (uint32 v = 0; v < new_image->height; v++)
+  for (int i = 0; i < 2; i++)
   {
-    for (uint32 w = 0; w < new_image->width; w++)
-    {
-      new_image->image[v][w] = img->image[(img->height - 1) - v][(img->width - 1) - w];
-    }
+    // b[4i+c] = columns 2c, 2c+1 of rows 4i..4i+3
+    b[4 * i + 0] = _mm_unpacklo_epi32(a[4 * i + 0], a[4 * i + 2]);
+    b[4 * i + 1] = _mm_unpackhi_epi32(a[4 * i + 0], a[4 * i + 2]);
+    b[4 * i + 2] = _mm_unpacklo_epi32(a[4 * i + 1], a[4 * i + 3]);
+    b[4 * i + 3] = _mm_unpackhi_epi32(a[4 * i + 1], a[4 * i + 3]);
+  }
+  for (int c = 0; c < 4; c++)
+  {
+    _mm_storeu_si128((__m128i *)(dst + (2 * c) * dst_step),
+                     _mm_unpacklo_epi64(b[c], b[4 + c]));
+    _mm_storeu_si128((__m128i *)(dst + (2 * c + 1) * dst_step),
+                     _mm_unpackhi_epi64(b[c], b[4 + c]));
+  }
+}
+
+// Same as above, with 8-bit labels.
+static inline void transpose8x8Labels8(const uint8 *src, ptrdiff_t src_step,
+                                       uint8 *dst, ptrdiff_t dst_step)
+{
+  __m128i r[8], a[4], b[4];
+  for (int i = 0; i < 8; i++)
+    r[i] = _mm_loadl_epi64((const __m128i *)(src + i * src_step));
+  for (int i = 0; i < 4; i++)
+    a[i] = _mm_unpacklo_epi8(r[2 * i], r[2 * i + 1]);
+  // b[0], b[1]: columns 0..3, 4..7 of rows 0..3; b[2], b[3]: of rows 4..7
+  b[0] = _mm_unpacklo_epi16(a[0], a[1]);
+  b[1] = _mm_unpackhi_epi16(a[0], a[1]);
+  b[2] = _mm_unpacklo_epi16(a[2], a[3]);
+  b[3] = _mm_unpackhi_epi16(a[2], a[3]);
+  for (int c = 0; c < 4; c++)
+  {
+    // Columns 2c, 2c+1 of rows 0..7
+    __m128i x = (c % 2 == 0) ? _mm_unpacklo_epi32(b[c / 2], b[2 + c / 2])
+                             : _mm_unpackhi_epi32(b[c / 2], b[2 + c / 2]);
+    _mm_storel_epi64((__m128i *)(dst + (2 * c) * dst_step), x);
+    _mm_storel_epi64((__m128i *)(dst + (2 * c + 1) * dst_step),
+                     _mm_srli_si128(x, 8));
+  }
+}
+#else
+static inline void transpose8x8Labels16(const uint16 *src, ptrdiff_t src_step,
+                                        uint16 *dst, ptrdiff_t dst_step)
+{
+  for (int i = 0; i < 8; i++)
+    for (int j = 0; j < 8; j++)
+      dst[j * dst_step + i] = src[i * src_step + j];
+}
+
+static inline void transpose8x8Labels8(const uint8 *src, ptrdiff_t src_step,
+                                       uint8 *dst, ptrdiff_t dst_step)
+{
+  for (int i = 0; i < 8; i++)
+    for (int j = 0; j < 8; j++)
+      dst[j * dst_step + i] = src[i * src_step + j];
+}
+#endif
+
+// Transpose the rows x cols labels at src into dst:
+// dst[j*dst_step + i] = src[i*src_step + j] (steps in labels, may be < 0).
+#define DEFINE_TRANSPOSE_LABELS(NAME, TYPE, KERNEL)                          \
+  static void NAME(const TYPE *src, ptrdiff_t src_step, TYPE *dst,           \
+                   ptrdiff_t dst_step, uint32 rows, uint32 cols)             \
+  {                                                                          \
+    for (uint32 i0 = 0; i0 < rows; i0 += TRANSPOSE_TILE)                     \
+    {                                                                        \
+      uint32 i1 = rows - i0 < TRANSPOSE_TILE ? rows : i0 + TRANSPOSE_TILE;   \
+      for (uint32 j0 = 0; j0 < cols; j0 += TRANSPOSE_TILE)                   \
+      {                                                                      \
+        uint32 j1 = cols - j0 < TRANSPOSE_TILE ? cols : j0 + TRANSPOSE_TILE; \
+        uint32 i = i0;                                                       \
+        for (; i + 8 <= i1; i += 8)                                          \
+        {                                                                    \
+          uint32 j = j0;                                                     \
+          for (; j + 8 <= j1; j += 8)                                        \
+            KERNEL(src + i * src_step + j, src_step,                         \
+                   dst + j * dst_step + i, dst_step);                        \
+          /* Right edge of the tile */                                       \
+          for (; j < j1; j++)                                                \
+            for (uint32 k = i; k < i + 8; k++)                               \
+              dst[j * dst_step + k] = src[k * src_step + j];                 \
+        }                                                                    \
+        /* Bottom edge of the tile */                                        \
+        for (; i < i1; i++)                                                  \
+          for (uint32 j = j0; j < j1; j++)                                   \
+            dst[j * dst_step + i] = src[i * src_step + j];                   \
+      }                                                                      \
+    }                                                                        \
+  }
+
+DEFINE_TRANSPOSE_LABELS(transposeLabels16, uint16, transpose8x8Labels16)
+DEFINE_TRANSPOSE_LABELS(transposeLabels8, uint8, transpose8x8Labels8)
+
+// Transpose the labels of img into dst (a img->height x img->width
+// image), with the same flips as transposeBits.
+static void transposeImage(const Image img, Image dst, int flip_src, int flip_dst)
+{
+  assert(dst->width == img->height && dst->height == img->width);
+  assert(dst->depth == img->depth);
+
+  if (img->depth == 1)
+  {
+    transposeBits(img, dst, flip_src, flip_dst);
+    return;
+  }
+
+  // Steps in labels; a flipped image is walked from its last row.
+  ptrdiff_t src_step = img->stride * 8 / img->depth;
+  ptrdiff_t dst_step = dst->stride * 8 / dst->depth;
+  size_t src_first = flip_src ? (size_t)(img->height - 1) * img->stride : 0;
+  size_t dst_first = flip_dst ? (size_t)(dst->height - 1) * dst->stride : 0;
+  if (flip_src)
+    src_step = -src_step;
+  if (flip_dst)
+    dst_step = -dst_step;
+
+  if (img->depth == 8)
+    transposeLabels8(img->pixels + src_first, src_step,
+                     dst->pixels + dst_first, dst_step,
+                     img->height, img->width);
+  else
+    transposeLabels16((const uint16 *)(img->pixels + src_first), src_step,
+                      (uint16 *)(dst->pixels + dst_first), dst_step,
+                      img->height, img->width);
+}
+
+// Create an empty width x height image with the LUT of img.
+static Image AllocateImageLike(const Image img, uint32 width, uint32 height)
+{
+  Image new_image = AllocateImageHeader(width, height);
+  if (new_image == NULL)
+    return NULL;
+
+  LUTReserve(new_image, img->num_colors);
+  for (uint16 lut_index = 0; lut_index < img->num_colors; lut_index++)
+  {
+    LUTAllocColor(new_image, img->LUT[lut_index]);
+  }
+  AllocatePixels(new_image);
+  assert(new_image->depth == img->depth);
+  return new_image;
+}
+
+// Write row src of img, reversed, into dst (a row of the same width
+// and depth; src != dst).  Padding bits of 1-bit rows stay WHITE.
+// 1-bit rows are reversed byte by byte (with ReverseBits), which moves
+// the padding bits to the front, and then shifted left over them.
+static void reverseRow(const Image img, const uint8 *src, uint8 *dst)
+{
+  assert(src != dst);
+  uint32 width = img->width;
+
+  if (img->depth == 16)
+  {
+    const uint16 *s16 = (const uint16 *)src + (width - 1);
+    uint16 *d16 = (uint16 *)dst;
+    for (uint32 w = 0; w < width; w++)
+      d16[w] = *s16--;
+    return;
+  }
+  if (img->depth == 8)
+  {
+    src += width - 1;
+    for (uint32 w = 0; w < width; w++)
+      dst[w] = *src--;
+    return;
+  }
+
+  pthread_once(&BitTablesOnce, InitBitTables);
+  uint32 nbytes = img->stride;
+  uint32 shift = 8 * nbytes - width; // padding bits of each row
+  uint32 skip = shift / 8, bits = shift % 8;
+  // Reversed row byte i is ReverseBits[src[nbytes-1-i]]
+  uint32 i = 0;
+  for (; i + skip < nbytes; i++)
+  {
+    uint32 hi = nbytes - 1 - (i + skip);
+    uint32 value = (uint32)ReverseBits[src[hi]] << 8;
+    if (hi > 0)
+      value |= ReverseBits[src[hi - 1]];
+    dst[i] = (uint8)(value >> (8 - bits));
+  }
+  memset(dst + i, 0, nbytes - i);
+}
+
+// The 2x2 matrix of signs that maps pixel coordinates (relative to the
+// center) of a view with the given orientation to its base.
+static void OrientationMatrix(uint32 orientation, int m[2][2])
+{
+  int su = (orientation & ORIENT_FLIP_HORIZONTAL) ? -1 : 1;
+  int sv = (orientation & ORIENT_FLIP_VERTICAL) ? -1 : 1;
+  int swap = (orientation & ORIENT_TRANSPOSE) != 0;
+  m[0][0] = swap ? 0 : su;
+  m[0][1] = swap ? sv : 0;
+  m[1][0] = swap ? su : 0;
+  m[1][1] = swap ? 0 : sv;
+}
+
+// The orientation of a view with orientation outer of a view with
+// orientation inner (the product of their matrices).
+static uint32 ComposeOrientations(uint32 outer, uint32 inner)
+{
+  int a[2][2], b[2][2], m[2][2];
+  OrientationMatrix(inner, a);
+  OrientationMatrix(outer, b);
+  for (int i = 0; i < 2; i++)
+    for (int j = 0; j < 2; j++)
+      m[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j];
+  int swap = m[0][0] == 0;
+  int su = swap ? m[1][0] : m[0][0];
+  int sv = swap ? m[0][1] : m[1][1];
+  return (su < 0 ? ORIENT_FLIP_HORIZONTAL : 0) | (sv < 0 ? ORIENT_FLIP_VERTICAL : 0) |
+         (swap ? ORIENT_TRANSPOSE : 0);
+}
+
+// Create the image that a view of img with the given orientation shows.
+// Orientations that swap the axes are transpositions, with the source or
+// the destination rows flipped; others copy (or reverse) whole rows.
+static Image ImageOriented(const Image img, uint32 orientation)
+{
+  if (img->base != NULL)
+    return ImageOriented(img->base, ComposeOrientations(orientation, img->orientation));
+
+  int flip_u = (orientation & ORIENT_FLIP_HORIZONTAL) != 0;
+  int flip_v = (orientation & ORIENT_FLIP_VERTICAL) != 0;
+  if (orientation & ORIENT_TRANSPOSE)
+  {
+    Image new_image = AllocateImageLike(img, img->height, img->width);
+    if (new_image == NULL)
+      return NULL;
+    transposeImage(img, new_image, flip_u, flip_v);
+    return new_image;
+  }
+
+  Image new_image = AllocateImageLike(img, img->width, img->height);
+  if (new_image == NULL)
+    return NULL;
+  for (uint32 v = 0; v < new_image->height; v++)
+  {
+    const uint8 *src = ImageRowBytes(img, flip_v ? (img->height - 1) - v : v);
+    if (flip_u)
+      reverseRow(img, src, ImageRowBytes(new_image, v));
+    else
+      memcpy(ImageRowBytes(new_image, v), src, img->stride);
   }
-
   return new_image;
 }
 
+/// Rotate 90 degrees clockwise (CW).
+/// Returns a rotated version of the image.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageRotate90CW(const Image img)
+{
+  assert(img != NULL);
+  return ImageOriented(img, ORIENT_ROTATE90CW);
+}
+
+/// Rotate 180 degrees clockwise (CW).
+/// Returns a rotated version of the image.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageRotate180CW(const Image img)
+{
+  assert(img != NULL);
+  return ImageOriented(img, ORIENT_ROTATE180);
+}
+
+/// Rotate 270 degrees clockwise (CW), i.e., 90 degrees counterclockwise.
+/// Returns a rotated version of the image.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageRotate270CW(const Image img)
+{
+  assert(img != NULL);
+  return ImageOriented(img, ORIENT_ROTATE270CW);
+}
+
+/// Transpose: pixel (u, v) of the new image is pixel (v, u) of img.
+/// Returns a transposed version of the image.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageTranspose(const Image img)
+{
+  assert(img != NULL);
+  return ImageOriented(img, ORIENT_TRANSPOSE);
+}
+
+/// Image views
+
+/// Create a view of img with the given orientation.
+/// If img is itself a view, the new view shows its base, with both
+/// orientations combined.
+/// (The caller is responsible for destroying the returned view!)
+Image ImageView(const Image img, Orientation orientation)
+{
+  assert(img != NULL);
+  assert((uint32)orientation <= ORIENT_ANTITRANSPOSE);
+
+  Image base = img;
+  uint32 combined = orientation;
+  if (img->base != NULL)
+  {
+    base = img->base;
+    combined = ComposeOrientations(orientation, img->orientation);
+  }
+
+  // A header with no pixels and an empty LUT of its own
+  Image view = calloc(1, sizeof(struct image));
+  // Error handling
+  check(view != NULL, "calloc");
+  int swap = (orientation & ORIENT_TRANSPOSE) != 0;
+  view->width = swap ? img->height : img->width;
+  view->height = swap ? img->width : img->height;
+  view->LUT = view->lut_inline;
+  view->lut_capacity = LUT_INLINE_SIZE;
+  view->base = base;
+  view->orientation = combined;
+  base->views++;
+  return view;
+}
+
+/// Create a new image with the pixels of img, which may be a view.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageMaterialize(const Image img)
+{
+  assert(img != NULL);
+  if (img->base == NULL)
+    return ImageCopy(img);
+  return ImageOriented(img->base, img->orientation);
+}
+
+/// In-place geometric transformations
+
+/// These functions transform the pixels of img itself, without a second
+/// copy of the image, so that images that only fit in memory once can
+/// still be rotated.  The LUT is not changed.
+
+// Label i of a packed array of labels with the given depth (bits).
+static inline uint32 packedGet(const uint8 *buf, uint32 depth, size_t i)
+{
+  if (depth == 16)
+    return ((const uint16 *)buf)[i];
+  if (depth == 8)
+    return buf[i];
+  return (buf[i >> 3] >> (7 - (i & 7))) & 1;
+}
+
+static inline void packedSet(uint8 *buf, uint32 depth, size_t i, uint32 label)
+{
+  if (depth == 16)
+    ((uint16 *)buf)[i] = (uint16)label;
+  else if (depth == 8)
+    buf[i] = (uint8)label;
+  else
+  {
+    uint8 mask = (uint8)(0x80 >> (i & 7));
+    buf[i >> 3] = (uint8)(label ? buf[i >> 3] | mask : buf[i >> 3] & ~mask);
+  }
+}
+
+// A zeroed buffer for one row of img.
+static uint8 *AllocateScratchRow(const Image img)
+{
+  uint8 *row = calloc(img->stride, 1);
+  check(row != NULL, "AllocateScratchRow");
+  return row;
+}
+
+/// Flip horizontally (mirror left-right), in place.
+/// Pixel (u, v) moves to (W-1-u, v).
+void ImageFlipHorizontal(Image img)
+{
+  assert(img != NULL);
+  assert(img->base == NULL); // see ImageMaterialize
+  InvalidateFingerprint(img);
+
+  uint8 *tmp = AllocateScratchRow(img);
+  for (uint32 v = 0; v < img->height; v++)
+  {
+    reverseRow(img, ImageRowBytes(img, v), tmp);
+    memcpy(ImageRowBytes(img, v), tmp, img->stride);
+  }
+  free(tmp);
+}
+
+/// Flip vertically (mirror top-bottom), in place.
+/// Pixel (u, v) moves to (u, H-1-v).
+void ImageFlipVertical(Image img)
+{
+  assert(img != NULL);
+  assert(img->base == NULL); // see ImageMaterialize
+  InvalidateFingerprint(img);
+
+  uint8 *tmp = AllocateScratchRow(img);
+  for (uint32 v = 0; v < img->height / 2; v++)
+  {
+    uint8 *top = ImageRowBytes(img, v);
+    uint8 *bottom = ImageRowBytes(img, img->height - 1 - v);
+    memcpy(tmp, top, img->stride);
+    memcpy(top, bottom, img->stride);
+    memcpy(bottom, tmp, img->stride);
+  }
+  free(tmp);
+}
+
+/// Rotate 180 degrees clockwise (CW), in place.
+/// Same result as ImageRotate180CW, without allocating a new image.
+void ImageRotate180CWInPlace(Image img)
+{
+  assert(img != NULL);
+  assert(img->base == NULL); // see ImageMaterialize
+  InvalidateFingerprint(img);
+
+  uint8 *tmp = AllocateScratchRow(img);
+  for (uint32 v = 0; v < (img->height + 1) / 2; v++)
+  {
+    // Rows v and H-1-v swap places, reversed (the middle row just reverses)
+    uint8 *top = ImageRowBytes(img, v);
+    uint8 *bottom = ImageRowBytes(img, img->height - 1 - v);
+    reverseRow(img, top, tmp);
+    if (bottom != top)
+      reverseRow(img, bottom, top);
+    memcpy(bottom, tmp, img->stride);
+  }
+  free(tmp);
+}
+
+// Rotate a square img 90 degrees CW in place, moving the pixels around
+// in cycles of 4: (u, v) -> (N-1-v, u) -> (N-1-u, N-1-v) -> (v, N-1-u).
+static void rotate90Square(Image img)
+{
+  uint32 n = img->width;
+  uint32 depth = img->depth;
+  for (uint32 i = 0; i < n / 2; i++)
+  {
+    uint8 *top = ImageRowBytes(img, i);
+    uint8 *bottom = ImageRowBytes(img, n - 1 - i);
+    for (uint32 j = i; j < n - 1 - i; j++)
+    {
+      uint8 *left = ImageRowBytes(img, n - 1 - j);
+      uint8 *right = ImageRowBytes(img, j);
+      uint32 tmp = packedGet(top, depth, j);
+      packedSet(top, depth, j, packedGet(left, depth, i));
+      packedSet(left, depth, i, packedGet(bottom, depth, n - 1 - j));
+      packedSet(bottom, depth, n - 1 - j, packedGet(right, depth, n - 1 - i));
+      packedSet(right, depth, n - 1 - i, tmp);
+    }
+  }
+}
+
+static uint32 gcd(uint32 a, uint32 b)
+{
+  while (b != 0)
+  {
+    uint32 r = a % b;
+    a = b;
+    b = r;
+  }
+  return a;
+}
+
+// Bytes per row of the strips of columns handled by transposeColumns
+// (at most TRANSPOSE_STRIP elements).
+#define TRANSPOSE_STRIP_BYTES 512
+#define TRANSPOSE_STRIP 64
+
+// A column pass of transposeElements, on the rows x cols matrix of
+// size-byte elements in buf.
+// In each column j, row i gets the element of row s(i, j) (gather), or
+// gives its element to row s(i, j) (scatter, the inverse permutation):
+//   rotate:  s = (i + j/b) mod rows
+//   shuffle: s = (d mod rows - (d div rows)/b) mod rows,  d = i*cols + j
+// where b = cols / gcd(rows, cols).
+// Columns are handled in strips, copied to strip (rows strip rows);
+// the indices are updated incrementally, without divisions.
+static void transposeColumns(uint8 *buf, size_t size, uint32 rows, uint32 cols,
+                             int shuffle, int scatter, uint8 *strip)
+{
+  uint32 b = cols / gcd(rows, cols);
+  uint32 step_mod = cols % rows, step_div = cols / rows;
+  uint32 strip_cols = TRANSPOSE_STRIP_BYTES / size;
+  if (strip_cols == 0)
+    strip_cols = 1;
+  if (strip_cols > TRANSPOSE_STRIP)
+    strip_cols = TRANSPOSE_STRIP;
+  uint32 dmod[TRANSPOSE_STRIP], qb[TRANSPOSE_STRIP], rb[TRANSPOSE_STRIP];
+
+  for (uint32 j0 = 0; j0 < cols; j0 += strip_cols)
+  {
+    uint32 w = cols - j0 < strip_cols ? cols - j0 : strip_cols;
+    size_t seg = w * size;
+    for (uint32 k = 0; k < w; k++)
+    {
+      uint32 j = j0 + k;
+      if (shuffle)
+      {
+        // d = j: dmod = d mod rows; d div rows = qb*b + rb
+        dmod[k] = j % rows;
+        qb[k] = j / rows / b;
+        rb[k] = j / rows % b;
+      }
+      else
+        dmod[k] = j / b; // < gcd(rows, cols) <= rows
+    }
+    if (!scatter)
+    {
+      for (uint32 i = 0; i < rows; i++)
+        memcpy(strip + i * seg, buf + ((size_t)i * cols + j0) * size, seg);
+    }
+
+    for (uint32 i = 0; i < rows; i++)
+    {
+      uint8 *row = buf + ((size_t)i * cols + j0) * size;
+      for (uint32 k = 0; k < w; k++)
+      {
+        // qb < gcd(rows, cols) <= rows
+        uint32 s = dmod[k];
+        if (shuffle)
+          s = s >= qb[k] ? s - qb[k] : s + rows - qb[k];
+        if (scatter)
+          memcpy(strip + s * seg + k * size, row + k * size, size);
+        else
+          memcpy(row + k * size, strip + s * seg + k * size, size);
+
+        // Next row: d += cols
+        if (shuffle)
+        {
+          uint32 carry = 0;
+          dmod[k] += step_mod;
+          if (dmod[k] >= rows)
+          {
+            dmod[k] -= rows;
+            carry = 1;
+          }
+          rb[k] += step_div + carry;
+          while (rb[k] >= b)
+          {
+            rb[k] -= b;
+            qb[k]++;
+          }
+        }
+        else
+          dmod[k] = dmod[k] + 1 == rows ? 0 : dmod[k] + 1;
+      }
+    }
+
+    if (scatter)
+    {
+      for (uint32 i = 0; i < rows; i++)
+        memcpy(buf + ((size_t)i * cols + j0) * size, strip + i * seg, seg);
+    }
+  }
+}
+
+// The row pass of transposeElements, on the rows x cols matrix of
+// size-byte elements in buf: in row i, the element of column j moves to
+// column (j*rows + (i + j/b) mod rows) mod cols, with
+// b = cols / gcd(rows, cols) (or, if inverse, comes from that column).
+// tmp holds a copy of the row.
+static void transposeRows(uint8 *buf, size_t size, uint32 rows, uint32 cols,
+                          int inverse, uint8 *tmp)
+{
+  uint32 b = cols / gcd(rows, cols);
+  uint32 step = rows % cols;
+  for (uint32 i = 0; i < rows; i++)
+  {
+    uint8 *row = buf + (size_t)i * cols * size;
+    memcpy(tmp, row, (size_t)cols * size);
+    uint32 jm = 0; // j*rows mod cols
+    for (uint32 j0 = 0, q = 0; j0 < cols; j0 += b, q++)
+    {
+      // q = j/b < gcd(rows, cols) <= rows
+      uint32 shift = (i + q < rows ? i + q : i + q - rows) % cols;
+      for (uint32 j = j0; j < j0 + b; j++)
+      {
+        uint32 col = jm + shift;
+        if (col >= cols)
+          col -= cols;
+        if (inverse)
+          memcpy(row + (size_t)j * size, tmp + (size_t)col * size, size);
+        else
+          memcpy(row + (size_t)col * size, tmp + (size_t)j * size, size);
+        jm += step;
+        if (jm >= cols)
+          jm -= cols;
+      }
+    }
+  }
+}
+
+// Transpose the rows x cols matrix of size-byte elements in buf, in
+// place: the element at r*cols + c moves to c*rows + r.
+// The permutation is split into (at most) three passes that each move
+// elements only within a row or only within a column: a column rotation,
+// a row scatter and a column shuffle (Catanzaro et al., "A decomposition
+// for in-place matrix transposition", PPoPP 2014).
+// The column passes run on the short side: a tall matrix is transposed
+// as the inverse of the transposition of a wide one, with the passes
+// inverted and in reverse order.
+static void transposeElements(uint8 *buf, size_t size, uint32 rows, uint32 cols)
+{
+  int inverse = rows > cols;
+  if (inverse)
+  {
+    uint32 tmp = rows;
+    rows = cols;
+    cols = tmp;
+  }
+  int rotate = gcd(rows, cols) > 1;
+
+  uint8 *strip = malloc((size_t)rows * (TRANSPOSE_STRIP_BYTES + size));
+  uint8 *tmp = malloc((size_t)cols * size);
+  check(strip != NULL && tmp != NULL, "transposeElements");
+
+  if (!inverse)
+  {
+    if (rotate)
+      transposeColumns(buf, size, rows, cols, 0, 0, strip);
+    transposeRows(buf, size, rows, cols, 0, tmp);
+    transposeColumns(buf, size, rows, cols, 1, 0, strip);
+  }
+  else
+  {
+    transposeColumns(buf, size, rows, cols, 1, 1, strip);
+    transposeRows(buf, size, rows, cols, 1, tmp);
+    if (rotate)
+      transposeColumns(buf, size, rows, cols, 0, 1, strip);
+  }
+
+  free(strip);
+  free(tmp);
+}
+
+// Rearrange the 8 rows (of stride bytes) at slab into consecutive tiles
+// of 8x8 pixels, each transposed: tile c holds columns 8c..8c+7, each
+// column as a row of 8 pixels (depth bytes).
+static void rowsToTiles(uint8 *slab, uint32 stride, uint32 depth, uint8 *tmp)
+{
+  uint32 tiles = stride / depth;
+  for (uint32 c = 0; c < tiles; c++)
+  {
+    uint8 *tile = tmp + (size_t)c * 8 * depth;
+    if (depth == 1)
+    {
+      uint64_t x = 0;
+      for (uint32 a = 0; a < 8; a++)
+        x |= (uint64_t)slab[a * stride + c] << (56 - 8 * a);
+      x = transpose8x8(x);
+      for (uint32 b = 0; b < 8; b++)
+        tile[b] = (uint8)(x >> (56 - 8 * b));
+    }
+    else if (depth == 8)
+      transpose8x8Labels8(slab + 8 * c, stride, tile, 8);
+    else
+      transpose8x8Labels16((const uint16 *)slab + 8 * c, stride / 2, (uint16 *)tile, 8);
+  }
+  memcpy(slab, tmp, (size_t)8 * stride);
+}
+
+// Rearrange the n consecutive tiles of 8x8 pixels at slab into 8 rows of
+// 8*n pixels: row b is made of row b of each tile.
+static void tilesToRows(uint8 *slab, uint32 n, uint32 depth, uint8 *tmp)
+{
+  size_t row_bytes = (size_t)n * depth;
+  if (depth == 1)
+    transposeLabels8(slab, 8, tmp, n, n, 8);
+  else
+  {
+    for (uint32 r = 0; r < n; r++)
+      for (uint32 b = 0; b < 8; b++)
+        memcpy(tmp + b * row_bytes + r * depth, slab + ((size_t)r * 8 + b) * depth, depth);
+  }
+  memcpy(slab, tmp, 8 * row_bytes);
+}
+
+// Bytes used by rotate90Packed on a width x height image: its rows
+// padded to a multiple of 8, and then the rotated image.
+static size_t Rotate90Bytes(uint32 width, uint32 height, uint32 depth)
+{
+  size_t tiled = (size_t)(height + 7) / 8 * 8 * StrideFor(width, depth);
+  size_t rotated = (size_t)width * StrideFor(height, depth);
+  return tiled > rotated ? tiled : rotated;
+}
+
+// Rotate a non-square img 90 degrees CW in place, as the transposition
+// of img flipped upside down, in tiles of 8x8 pixels: the rows (and
+// their padding, a whole number of tiles) are padded to a multiple of 8
+// with WHITE rows and cut into tiles, the matrix of tiles is transposed,
+// and the tiles are put back together into rows, which get their padding.
+// The extra rows and padding may need a bigger block, grown on demand:
+// realloc remaps large (mmap-backed) blocks instead of copying them.
+static void rotate90Packed(Image img)
+{
+  uint32 width = img->width, height = img->height;
+  uint32 depth = img->depth, stride = img->stride;
+  uint32 tile_rows = (height + 7) / 8, tile_cols = stride / depth;
+  size_t tile_bytes = (size_t)8 * depth;
+
+  size_t needed = Rotate90Bytes(width, height, depth);
+  if (needed > img->pixcap)
+  {
+    // realloc may change the alignment of the pixels
+    size_t offset = (size_t)(img->pixels - (uint8 *)img->pixmem);
+    void *pixmem = realloc(img->pixmem, needed + PIXEL_ALIGN);
+    check(pixmem != NULL, "ImageRotate90CWInPlace");
+    uintptr_t addr = ((uintptr_t)pixmem + PIXEL_ALIGN - 1) & ~(uintptr_t)(PIXEL_ALIGN - 1);
+    memmove((uint8 *)addr, (uint8 *)pixmem + offset, ImagePixelBytes(img));
+    img->pixmem = pixmem;
+    img->pixels = (uint8 *)addr;
+    img->pixcap = needed;
+  }
+
+  ImageFlipVertical(img);
+  memset(ImageRowBytes(img, height), 0, ((size_t)tile_rows * 8 - height) * stride);
+
+  size_t tmp_bytes = (size_t)8 * stride;
+  if (tmp_bytes < tile_rows * tile_bytes)
+    tmp_bytes = tile_rows * tile_bytes;
+  uint8 *tmp = malloc(tmp_bytes);
+  check(tmp != NULL, "ImageRotate90CWInPlace");
+
+  for (uint32 r = 0; r < tile_rows; r++)
+    rowsToTiles(img->pixels + (size_t)r * 8 * stride, stride, depth, tmp);
+  transposeElements(img->pixels, tile_bytes, tile_rows, tile_cols);
+  for (uint32 c = 0; c < tile_cols; c++)
+    tilesToRows(img->pixels + (size_t)c * tile_rows * tile_bytes, tile_rows, depth, tmp);
+  free(tmp);
+
+  // The first width rows (of tile_rows*depth bytes) are the new rows:
+  // give them their padding, last row first.
+  img->width = height;
+  img->height = width;
+  img->stride = StrideFor(img->width, depth);
+  size_t row_bytes = (size_t)tile_rows * depth;
+  for (uint32 v = img->height; v-- > 0;)
+  {
+    uint8 *row = ImageRowBytes(img, v);
+    memmove(row, img->pixels + v * row_bytes, row_bytes);
+    memset(row + row_bytes, 0, img->stride - row_bytes);
+  }
+}
+
+/// Rotate 90 degrees clockwise (CW), in place.
+/// Same result as ImageRotate90CW, without allocating a new image:
+/// square images are rotated in cycles of 4 pixels; other images are
+/// transposed in tiles of 8x8 pixels, with scratch memory for a few rows,
+/// and their pixel block may grow by the padding of the new rows.
+/// A non-square img must have no views, whose dimensions would no longer
+/// match it: that is checked.
+void ImageRotate90CWInPlace(Image img)
+{
+  assert(img != NULL);
+  assert(img->base == NULL); // see ImageMaterialize
+  InvalidateFingerprint(img);
+
+  if (img->width == img->height)
+    rotate90Square(img);
+  else
+  {
+    check(img->views == 0, "ImageRotate90CWInPlace: image has views");
+    rotate90Packed(img);
+  }
+}
+
 /// Check whether pixel coords (u, v) are inside img.
 /// ATTENTION
 ///   u : column index
@@ -747,7 +2730,7 @@ int ImageIsValidPixel(const Image img, int u, int v)
 
 /// Region Growing
 
-/// The following three *RegionFilling* functions perform region growing
+/// The following four *RegionFilling* functions perform region growing
 /// using some variation of the 4-neighbors flood-filling algorithm:
 ///   Given the coordinates (u, v) of a seed pixel,
 ///   fill all similarly-colored adjacent pixels with a new color label.
@@ -761,16 +2744,30 @@ int ImageIsValidPixel(const Image img, int u, int v)
 
 /// Each function carries out a different version of the algorithm.
 
+// A fill of a view paints the same region of its base (flips and
+// rotations keep 4-neighbors adjacent): map the seed (u, v) to the base.
+static Image FillTarget(Image img, int *u, int *v)
+{
+  if (img->base == NULL)
+    return img;
+  uint32 bu = (uint32)*u, bv = (uint32)*v;
+  ViewToBase(img, &bu, &bv);
+  *u = (int)bu;
+  *v = (int)bv;
+  return img->base;
+}
+
 static int canPaint(Image img, int u, int v, uint16 label, uint16 original_label)
 {
-  PIXVALIDATIONS++;
+  COUNT(PIXVALIDATIONS, 1);
   if (!ImageIsValidPixel(img, u, v)) 
     return 0;
-  PIXREADS++;
-  if (img->image[v][u] == label)
+  uint16 pixel = PixelGet(img, u, v);
+  COUNT(PIXREADS, 1);
+  if (pixel == label)
     return 0;
-  PIXREADS++;
-  if (img->image[v][u] != original_label)
+  COUNT(PIXREADS, 1);
+  if (pixel != original_label)
     return 0;
   return 1;
 }
@@ -782,14 +2779,13 @@ static int canPaintC(Image img, PixelCoords coords, uint16 label, uint16 origina
 
 static int _imageRegionFillingRecursive(Image img, int u, int v, uint16 label, uint16 original_label, int depth)
 {
-  if ((unsigned long)depth > PEAKRECDEPTH)
-    PEAKRECDEPTH = (unsigned long)depth;
+  COUNT_PEAK(PEAKRECDEPTH, (unsigned long)depth);
   if (!canPaint(img, u, v, label, original_label))
   {
     return 0;
   }
-  img->image[v][u] = label;
-  PIXWRITES++;
+  PixelSet(img, u, v, label);
+  COUNT(PIXWRITES, 1);
   int output = 1;
   int next_depth = depth + 1;
   output += _imageRegionFillingRecursive(img, u - 1, v, label, original_label, next_depth);
@@ -804,23 +2800,24 @@ int ImageRegionFillingRecursive(Image img, int u, int v, uint16 label)
 {
   assert(img != NULL);
   assert(ImageIsValidPixel(img, u, v));
+  img = FillTarget(img, &u, &v);
   assert(label < img->num_colors);
-  return _imageRegionFillingRecursive(img, u, v, label, img->image[v][u], 1);
+  InvalidateFingerprint(img);
+  return _imageRegionFillingRecursive(img, u, v, label, PixelGet(img, u, v), 1);
 }
 
 static int _imageRegionFillingWithSTACK(Image img, uint16 label, uint16 original_label, Stack *stack)
 {
-  PixelCoords coords = StackPop(stack); STACKOPS++;
+  PixelCoords coords = StackPop(stack); COUNT(STACKOPS, 1);
   if (!canPaintC(img, coords, label, original_label))
     return 0;
-  img->image[coords.v][coords.u] = label;
-  PIXWRITES++;
-  StackPush(stack, PixelCoordsCreate(coords.u - 1, coords.v)); STACKOPS++;
-  StackPush(stack, PixelCoordsCreate(coords.u, coords.v - 1)); STACKOPS++;
-  StackPush(stack, PixelCoordsCreate(coords.u + 1, coords.v)); STACKOPS++;
-  StackPush(stack, PixelCoordsCreate(coords.u, coords.v + 1)); STACKOPS++;
-  if (StackSize(stack) > PEAKSTACK)
-    PEAKSTACK = StackSize(stack);
+  PixelSet(img, coords.u, coords.v, label);
+  COUNT(PIXWRITES, 1);
+  StackPush(stack, PixelCoordsCreate(coords.u - 1, coords.v)); COUNT(STACKOPS, 1);
+  StackPush(stack, PixelCoordsCreate(coords.u, coords.v - 1)); COUNT(STACKOPS, 1);
+  StackPush(stack, PixelCoordsCreate(coords.u + 1, coords.v)); COUNT(STACKOPS, 1);
+  StackPush(stack, PixelCoordsCreate(coords.u, coords.v + 1)); COUNT(STACKOPS, 1);
+  COUNT_PEAK(PEAKSTACK, StackSize(stack));
   return 1;
 }
 
@@ -830,20 +2827,22 @@ int ImageRegionFillingWithSTACK(Image img, int u, int v, uint16 label)
 {
   assert(img != NULL);
   assert(ImageIsValidPixel(img, u, v));
-  assert(label < FIXED_LUT_SIZE);
+  img = FillTarget(img, &u, &v);
+  assert(label < img->num_colors);
+  InvalidateFingerprint(img);
 
-  PIXREADS++;
-  PIXVALIDATIONS++;
-  if (img->image[v][u] == label)
+  COUNT(PIXREADS, 1);
+  COUNT(PIXVALIDATIONS, 1);
+  if (PixelGet(img, u, v) == label)
     return 0;
 
   Stack *stack = StackCreate(img->height * img->width / 4 * 3);
   assert(stack != NULL);
 
-  StackPush(stack, PixelCoordsCreate(u, v)); STACKOPS++;
-  PEAKSTACK = StackSize(stack);
+  StackPush(stack, PixelCoordsCreate(u, v)); COUNT(STACKOPS, 1);
+  COUNT_SET(PEAKSTACK, StackSize(stack));
 
-  uint16 original_label = img->image[v][u];
+  uint16 original_label = PixelGet(img, u, v);
 
   int paintedPixels = 0;
   while (!StackIsEmpty(stack))
@@ -854,17 +2853,16 @@ int ImageRegionFillingWithSTACK(Image img, int u, int v, uint16 label)
 
 static int _imageRegionFillingWithQUEUE(Image img, uint16 label, uint16 original_label, Queue *queue)
 {
-  PixelCoords coords = QueueDequeue(queue); QUEUEOPS++;
+  PixelCoords coords = QueueDequeue(queue); COUNT(QUEUEOPS, 1);
   if (!canPaintC(img, coords, label, original_label))
     return 0;
-  img->image[coords.v][coords.u] = label;
-  PIXWRITES++;
-  QueueEnqueue(queue, PixelCoordsCreate(coords.u - 1, coords.v)); QUEUEOPS++;
-  QueueEnqueue(queue, PixelCoordsCreate(coords.u, coords.v - 1)); QUEUEOPS++;
-  QueueEnqueue(queue, PixelCoordsCreate(coords.u + 1, coords.v)); QUEUEOPS++;
-  QueueEnqueue(queue, PixelCoordsCreate(coords.u, coords.v + 1)); QUEUEOPS++;
-  if (QueueSize(queue) > PEAKQUEUE)
-    PEAKQUEUE = QueueSize(queue);
+  PixelSet(img, coords.u, coords.v, label);
+  COUNT(PIXWRITES, 1);
+  QueueEnqueue(queue, PixelCoordsCreate(coords.u - 1, coords.v)); COUNT(QUEUEOPS, 1);
+  QueueEnqueue(queue, PixelCoordsCreate(coords.u, coords.v - 1)); COUNT(QUEUEOPS, 1);
+  QueueEnqueue(queue, PixelCoordsCreate(coords.u + 1, coords.v)); COUNT(QUEUEOPS, 1);
+  QueueEnqueue(queue, PixelCoordsCreate(coords.u, coords.v + 1)); COUNT(QUEUEOPS, 1);
+  COUNT_PEAK(PEAKQUEUE, QueueSize(queue));
   return 1;
 }
 
@@ -874,20 +2872,22 @@ int ImageRegionFillingWithQUEUE(Image img, int u, int v, uint16 label)
 {
   assert(img != NULL);
   assert(ImageIsValidPixel(img, u, v));
-  assert(label < FIXED_LUT_SIZE);
+  img = FillTarget(img, &u, &v);
+  assert(label < img->num_colors);
+  InvalidateFingerprint(img);
 
-  PIXREADS++;
-  PIXVALIDATIONS++;
-  if (img->image[v][u] == label)
+  COUNT(PIXREADS, 1);
+  COUNT(PIXVALIDATIONS, 1);
+  if (PixelGet(img, u, v) == label)
     return 0;
 
   Queue *queue = QueueCreate(img->height * img->width / 4 * 3);
   assert(queue != NULL);
 
-  QueueEnqueue(queue, PixelCoordsCreate(u, v)); QUEUEOPS++;
-  PEAKQUEUE = QueueSize(queue);
+  QueueEnqueue(queue, PixelCoordsCreate(u, v)); COUNT(QUEUEOPS, 1);
+  COUNT_SET(PEAKQUEUE, QueueSize(queue));
 
-  uint16 original_label = img->image[v][u];
+  uint16 original_label = PixelGet(img, u, v);
 
   int paintedPixels = 0;
   while (!QueueIsEmpty(queue))
@@ -896,29 +2896,349 @@ int ImageRegionFillingWithQUEUE(Image img, int u, int v, uint16 label)
   return paintedPixels;
 }
 
-/// Image Segmentation
-
-/// Label each WHITE region with a different color.
-/// - WHITE (the background color) has label (LUT index) 0.
-/// - Use GenerateNextColor to create the RGB color for each new region.
-///
-/// One of the region filling functions above is passed as the
-/// last argument, using a function pointer.
-///
-/// Returns the number of image regions found.
-int ImageSegmentation(Image img, FillingFunction fillFunct)
+// Push one seed for each run of paintable pixels of row v in [left, right].
+static void _pushScanlineSeeds(Image img, int left, int right, int v, uint16 label, uint16 original_label, Stack *stack)
 {
-  assert(img != NULL);
-  assert(fillFunct != NULL);
+  int in_run = 0;
+  for (int x = left; x <= right; x++)
+  {
+    if (canPaint(img, x, v, label, original_label))
+    {
+      if (!in_run)
+      {
+        StackPush(stack, PixelCoordsCreate(x, v)); COUNT(STACKOPS, 1);
+        in_run = 1;
+      }
+    }
+    else
+    {
+      in_run = 0;
+    }
+  }
+}
+
+static int _imageRegionFillingScanline(Image img, uint16 label, uint16 original_label, Stack *stack)
+{
+  PixelCoords coords = StackPop(stack); COUNT(STACKOPS, 1);
+  if (!canPaintC(img, coords, label, original_label))
+    return 0;
+
+  // Extend the span to the left and to the right of the seed
+  int left = coords.u;
+  while (canPaint(img, left - 1, coords.v, label, original_label))
+    left--;
+  int right = coords.u;
+  while (canPaint(img, right + 1, coords.v, label, original_label))
+    right++;
+
+  // Paint the whole span
+  PixelSetSpan(img, coords.v, left, right + 1, label);
+  COUNT(PIXWRITES, right - left + 1);
+
+  // Seed the runs of the rows above and below the span
+  _pushScanlineSeeds(img, left, right, coords.v - 1, label, original_label, stack);
+  _pushScanlineSeeds(img, left, right, coords.v + 1, label, original_label, stack);
+  COUNT_PEAK(PEAKSTACK, StackSize(stack));
+  return right - left + 1;
+}
+
+/// Region growing using the scanline flood-filling algorithm:
+/// whole horizontal spans are painted at once, and a STACK only holds
+/// one seed for each run of paintable pixels in the adjacent rows.
+int ImageRegionFillingScanline(Image img, int u, int v, uint16 label)
+{
+  assert(img != NULL);
+  assert(ImageIsValidPixel(img, u, v));
+  img = FillTarget(img, &u, &v);
+  assert(label < img->num_colors);
+  InvalidateFingerprint(img);
+
+  COUNT(PIXREADS, 1);
+  COUNT(PIXVALIDATIONS, 1);
+  if (PixelGet(img, u, v) == label)
+    return 0;
+
+  // Seeds are kept per run, so the stack is usually much smaller
+  // than the region; StackPush grows it if needed.
+  Stack *stack = StackCreate(img->width + img->height);
+  assert(stack != NULL);
+
+  StackPush(stack, PixelCoordsCreate(u, v)); COUNT(STACKOPS, 1);
+  COUNT_SET(PEAKSTACK, StackSize(stack));
+
+  uint16 original_label = PixelGet(img, u, v);
+
+  int paintedPixels = 0;
+  while (!StackIsEmpty(stack))
+    paintedPixels += _imageRegionFillingScanline(img, label, original_label, stack);
+  StackDestroy(&stack);
+  return paintedPixels;
+}
+
+/// Region filling with a reusable context
+
+// A fill context owns the working storage of the STACK, QUEUE and
+// scanline fills, so that many fills (e.g., all the fills of one
+// segmentation) share one allocation instead of creating and destroying
+// a stack or queue per region.
+//
+// The context fills also use a visited bitmap (one bit per pixel):
+// a pixel is marked when pushed, so it is never pushed twice.
+// After each fill, only the rows touched by that fill are cleared.
+struct fillContext
+{
+  Stack *stack;     // reused by the STACK and scanline fills
+  Queue *queue;     // reused by the QUEUE fill
+  uint64_t *visited; // visited bitmap, words_per_row words per row
+  size_t visited_words; // number of words allocated for visited
+  uint32 words_per_row; // bitmap row stride of the current image
+  uint32 vmin, vmax;    // range of bitmap rows marked by the current fill
+};
+
+// Make the bitmap of ctx fit img, and clear it.
+static void FillContextPrepare(FillContext ctx, const Image img)
+{
+  uint32 words_per_row = (img->width + 63) / 64;
+  size_t words = (size_t)words_per_row * img->height;
+  if (words > ctx->visited_words)
+  {
+    free(ctx->visited);
+    ctx->visited = calloc(words, sizeof(uint64_t));
+    // Error handling
+    check(ctx->visited != NULL, "Alloc failed ->visited bitmap");
+    ctx->visited_words = words;
+  }
+  else if (words_per_row != ctx->words_per_row)
+  {
+    // Layout changes: rows cleared by previous fills no longer line up
+    memset(ctx->visited, 0, words * sizeof(uint64_t));
+  }
+  ctx->words_per_row = words_per_row;
+  ctx->vmin = img->height;
+  ctx->vmax = 0;
+}
+
+// Test and set the visited bit of pixel (u, v).
+// Returns the previous value of the bit.
+static inline int FillContextVisit(FillContext ctx, int u, int v)
+{
+  uint64_t *word = &ctx->visited[(size_t)v * ctx->words_per_row + ((uint32)u >> 6)];
+  uint64_t bit = (uint64_t)1 << (u & 63);
+  if (*word & bit)
+    return 1;
+  *word |= bit;
+  if ((uint32)v < ctx->vmin)
+    ctx->vmin = (uint32)v;
+  if ((uint32)v > ctx->vmax)
+    ctx->vmax = (uint32)v;
+  return 0;
+}
+
+// Clear the bitmap rows marked by the last fill.
+static void FillContextFinish(FillContext ctx)
+{
+  if (ctx->vmin <= ctx->vmax)
+  {
+    memset(ctx->visited + (size_t)ctx->vmin * ctx->words_per_row, 0,
+           (size_t)(ctx->vmax - ctx->vmin + 1) * ctx->words_per_row * sizeof(uint64_t));
+  }
+  ctx->vmin = UINT32_MAX;
+  ctx->vmax = 0;
+}
+
+/// Create a fill context for images of the dimensions of img.
+FillContext FillContextCreate(const Image img)
+{
+  assert(img != NULL);
+
+  FillContext ctx = malloc(sizeof(struct fillContext));
+  // Error handling
+  check(ctx != NULL, "malloc");
+
+  // Start with room for a few rows of seeds; both grow when needed
+  uint32 size = img->width + img->height;
+  ctx->stack = StackCreate(size);
+  ctx->queue = QueueCreate(size);
+  ctx->visited = NULL;
+  ctx->visited_words = 0;
+  ctx->words_per_row = 0;
+  FillContextPrepare(ctx, img);
+  return ctx;
+}
+
+/// Destroy the fill context pointed to by (*ctxp).
+void FillContextDestroy(FillContext *ctxp)
+{
+  assert(ctxp != NULL);
+
+  FillContext ctx = *ctxp;
+  if (ctx == NULL)
+    return;
+
+  StackDestroy(&ctx->stack);
+  QueueDestroy(&ctx->queue);
+  free(ctx->visited);
+  free(ctx);
+
+  *ctxp = NULL;
+}
+
+// Push (u, v) if it can be painted and was not pushed before.
+static inline void _pushIfPaintable(FillContext ctx, Image img, int u, int v, uint16 label, uint16 original_label)
+{
+  if (canPaint(img, u, v, label, original_label) && !FillContextVisit(ctx, u, v))
+  {
+    StackPush(ctx->stack, PixelCoordsCreate(u, v)); COUNT(STACKOPS, 1);
+  }
+}
+
+static inline void _enqueueIfPaintable(FillContext ctx, Image img, int u, int v, uint16 label, uint16 original_label)
+{
+  if (canPaint(img, u, v, label, original_label) && !FillContextVisit(ctx, u, v))
+  {
+    QueueEnqueue(ctx->queue, PixelCoordsCreate(u, v)); COUNT(QUEUEOPS, 1);
+  }
+}
+
+/// Region growing using the STACK of a fill context.
+int ImageRegionFillingWithSTACKCtx(FillContext ctx, Image img, int u, int v, uint16 label)
+{
+  assert(ctx != NULL);
+  assert(img != NULL);
+  assert(ImageIsValidPixel(img, u, v));
+  img = FillTarget(img, &u, &v);
+  assert(label < img->num_colors);
+  InvalidateFingerprint(img);
+
+  COUNT(PIXREADS, 1);
+  COUNT(PIXVALIDATIONS, 1);
+  if (PixelGet(img, u, v) == label)
+    return 0;
+
+  FillContextPrepare(ctx, img);
+  Stack *stack = ctx->stack;
+  StackClear(stack);
+  uint16 original_label = PixelGet(img, u, v);
+
+  FillContextVisit(ctx, u, v);
+  StackPush(stack, PixelCoordsCreate(u, v)); COUNT(STACKOPS, 1);
+  COUNT_SET(PEAKSTACK, StackSize(stack));
+
+  int paintedPixels = 0;
+  while (!StackIsEmpty(stack))
+  {
+    // Pushed pixels were checked with canPaint, and are painted only here
+    PixelCoords coords = StackPop(stack); COUNT(STACKOPS, 1);
+    PixelSet(img, coords.u, coords.v, label);
+    COUNT(PIXWRITES, 1);
+    paintedPixels++;
+    _pushIfPaintable(ctx, img, coords.u - 1, coords.v, label, original_label);
+    _pushIfPaintable(ctx, img, coords.u, coords.v - 1, label, original_label);
+    _pushIfPaintable(ctx, img, coords.u + 1, coords.v, label, original_label);
+    _pushIfPaintable(ctx, img, coords.u, coords.v + 1, label, original_label);
+    COUNT_PEAK(PEAKSTACK, StackSize(stack));
+  }
+  FillContextFinish(ctx);
+  return paintedPixels;
+}
+
+/// Region growing using the QUEUE of a fill context.
+int ImageRegionFillingWithQUEUECtx(FillContext ctx, Image img, int u, int v, uint16 label)
+{
+  assert(ctx != NULL);
+  assert(img != NULL);
+  assert(ImageIsValidPixel(img, u, v));
+  img = FillTarget(img, &u, &v);
+  assert(label < img->num_colors);
+  InvalidateFingerprint(img);
+
+  COUNT(PIXREADS, 1);
+  COUNT(PIXVALIDATIONS, 1);
+  if (PixelGet(img, u, v) == label)
+    return 0;
+
+  FillContextPrepare(ctx, img);
+  Queue *queue = ctx->queue;
+  QueueClear(queue);
+  uint16 original_label = PixelGet(img, u, v);
+
+  FillContextVisit(ctx, u, v);
+  QueueEnqueue(queue, PixelCoordsCreate(u, v)); COUNT(QUEUEOPS, 1);
+  COUNT_SET(PEAKQUEUE, QueueSize(queue));
+
+  int paintedPixels = 0;
+  while (!QueueIsEmpty(queue))
+  {
+    // Enqueued pixels were checked with canPaint, and are painted only here
+    PixelCoords coords = QueueDequeue(queue); COUNT(QUEUEOPS, 1);
+    PixelSet(img, coords.u, coords.v, label);
+    COUNT(PIXWRITES, 1);
+    paintedPixels++;
+    _enqueueIfPaintable(ctx, img, coords.u - 1, coords.v, label, original_label);
+    _enqueueIfPaintable(ctx, img, coords.u, coords.v - 1, label, original_label);
+    _enqueueIfPaintable(ctx, img, coords.u + 1, coords.v, label, original_label);
+    _enqueueIfPaintable(ctx, img, coords.u, coords.v + 1, label, original_label);
+    COUNT_PEAK(PEAKQUEUE, QueueSize(queue));
+  }
+  FillContextFinish(ctx);
+  return paintedPixels;
+}
+
+/// Region growing using the scanline algorithm and the STACK of a
+/// fill context.
+int ImageRegionFillingScanlineCtx(FillContext ctx, Image img, int u, int v, uint16 label)
+{
+  assert(ctx != NULL);
+  assert(img != NULL);
+  assert(ImageIsValidPixel(img, u, v));
+  img = FillTarget(img, &u, &v);
+  assert(label < img->num_colors);
+  InvalidateFingerprint(img);
+
+  COUNT(PIXREADS, 1);
+  COUNT(PIXVALIDATIONS, 1);
+  if (PixelGet(img, u, v) == label)
+    return 0;
+
+  // Spans never revisit painted pixels: the bitmap is not needed
+  Stack *stack = ctx->stack;
+  StackClear(stack);
+  StackPush(stack, PixelCoordsCreate(u, v)); COUNT(STACKOPS, 1);
+  COUNT_SET(PEAKSTACK, StackSize(stack));
+
+  uint16 original_label = PixelGet(img, u, v);
+
+  int paintedPixels = 0;
+  while (!StackIsEmpty(stack))
+    paintedPixels += _imageRegionFillingScanline(img, label, original_label, stack);
+  return paintedPixels;
+}
+
+/// Image Segmentation
+
+/// Label each WHITE region with a different color.
+/// - WHITE (the background color) has label (LUT index) 0.
+/// - Use GenerateNextColor to create the RGB color for each new region.
+///
+/// One of the region filling functions above is passed as the
+/// last argument, using a function pointer.
+///
+/// Returns the number of image regions found.
+int ImageSegmentation(Image img, FillingFunction fillFunct)
+{
+  assert(img != NULL);
+  assert(fillFunct != NULL);
+  assert(img->base == NULL); // see ImageMaterialize
 
   int regions = 0;
   rgb_t color = GenerateNextColor(0);
   int label;
-  for (uint16 v = 0; v < img->height; v++) {
-    for (uint16 u = 0; u < img->width; u++) {
-      PIXREADS++;
-      PIXVALIDATIONS++;
-      if (img->image[v][u] == 0) {
+  for (uint32 v = 0; v < img->height; v++) {
+    // (No row pointers: allocating a label may widen the pixel block)
+    for (uint32 u = 0; u < img->width; u++) {
+      COUNT(PIXREADS, 1);
+      COUNT(PIXVALIDATIONS, 1);
+      if (PixelGet(img, u, v) == 0) {
         regions++;
         color = GenerateNextColor(color);
         label = LUTAllocColor(img, color);
@@ -930,3 +3250,870 @@ int ImageSegmentation(Image img, FillingFunction fillFunct)
 
   return regions;
 }
+
+/// Label each WHITE region with a different color, like ImageSegmentation,
+/// but filling all the regions with the same fill context.
+///
+/// Returns the number of image regions found.
+int ImageSegmentationWithContext(Image img, FillContext ctx, FillingFunctionCtx fillFunct)
+{
+  assert(img != NULL);
+  assert(ctx != NULL);
+  assert(img->base == NULL); // see ImageMaterialize
+  assert(fillFunct != NULL);
+
+  int regions = 0;
+  rgb_t color = GenerateNextColor(0);
+  int label;
+  for (uint32 v = 0; v < img->height; v++) {
+    // (No row pointers: allocating a label may widen the pixel block)
+    for (uint32 u = 0; u < img->width; u++) {
+      COUNT(PIXREADS, 1);
+      COUNT(PIXVALIDATIONS, 1);
+      if (PixelGet(img, u, v) == 0) {
+        regions++;
+        color = GenerateNextColor(color);
+        label = LUTAllocColor(img, color);
+        // u = column index, v = row index
+        fillFunct(ctx, img, u, v, label);
+      }
+    }
+  }
+
+  return regions;
+}
+
+/// Union-find segmentation
+
+// The union-find engine works on horizontal runs of WHITE pixels.
+// Pass 1 extracts the runs of each row and unites every run with the
+// runs of the previous row that overlap it (4-connectivity).
+// The union-find root of a region is always its first run in raster order,
+// so pass 2 can visit the runs in raster order and allocate region labels
+// in exactly the same order as the fill-based ImageSegmentation.
+
+// A run of WHITE pixels [u0, u1) in row v.
+typedef struct
+{
+  uint32 v;
+  uint32 u0;
+  uint32 u1;
+  uint32 parent; // union-find parent (index of another run)
+  uint16 label;  // region label (set in pass 2)
+} Run;
+
+// A growable array of runs, in raster order.
+typedef struct
+{
+  Run *runs;
+  size_t count;
+  size_t capacity;
+} RunTable;
+
+static void RunTableInit(RunTable *rt, size_t capacity)
+{
+  if (capacity < 16)
+    capacity = 16;
+  rt->runs = malloc(capacity * sizeof(Run));
+  // Error handling
+  check(rt->runs != NULL, "Alloc failed ->runs array");
+  rt->count = 0;
+  rt->capacity = capacity;
+}
+
+static void RunTableFree(RunTable *rt)
+{
+  free(rt->runs);
+  rt->runs = NULL;
+  rt->count = rt->capacity = 0;
+}
+
+static uint32 RunTablePush(RunTable *rt, uint32 v, uint32 u0, uint32 u1)
+{
+  if (rt->count == rt->capacity)
+  {
+    rt->capacity *= 2;
+    Run *runs = realloc(rt->runs, rt->capacity * sizeof(Run));
+    // Error handling
+    check(runs != NULL, "Alloc failed ->runs array");
+    rt->runs = runs;
+  }
+  check(rt->count < UINT32_MAX, "Too many runs");
+  uint32 i = (uint32)rt->count++;
+  Run *r = &rt->runs[i];
+  r->v = v;
+  r->u0 = u0;
+  r->u1 = u1;
+  r->parent = i;
+  r->label = 0;
+  return i;
+}
+
+// Find the root of run i (with path halving).
+static uint32 RunFind(Run *runs, uint32 i)
+{
+  while (runs[i].parent != i)
+  {
+    runs[i].parent = runs[runs[i].parent].parent;
+    i = runs[i].parent;
+  }
+  return i;
+}
+
+// Unite the regions of runs a and b.
+// The root with the smallest index (first in raster order) wins.
+// Returns the root that stopped being a root, or UINT32_MAX if none.
+static uint32 RunUnion(Run *runs, uint32 a, uint32 b)
+{
+  a = RunFind(runs, a);
+  b = RunFind(runs, b);
+  if (a < b)
+  {
+    runs[b].parent = a;
+    return b;
+  }
+  if (b < a)
+  {
+    runs[a].parent = b;
+    return a;
+  }
+  return UINT32_MAX;
+}
+
+// Unite the runs [cur, cur_end) of a row with the overlapping runs
+// [prev, prev_end) of the row above.
+static void RunUniteRows(Run *runs, uint32 prev, uint32 prev_end, uint32 cur, uint32 cur_end)
+{
+  while (prev < prev_end && cur < cur_end)
+  {
+    if (runs[prev].u1 > runs[cur].u0 && runs[cur].u1 > runs[prev].u0)
+      RunUnion(runs, prev, cur);
+    // Advance the run that ends first
+    if (runs[prev].u1 < runs[cur].u1)
+      prev++;
+    else
+      cur++;
+  }
+}
+
+// First u' >= u (or width) where the 1-bit row has a bit other than bit.
+// Whole bytes of equal bits are skipped at once.
+static inline uint32 skipBits(const uint8 *row, uint32 u, uint32 width, int bit)
+{
+  const uint8 same = bit ? 0xff : 0x00;
+  while (u < width)
+  {
+    if ((u & 7) == 0 && row[u >> 3] == same)
+      u += 8;
+    else if (((row[u >> 3] >> (7 - (u & 7))) & 1) != bit)
+      return u;
+    else
+      u++;
+  }
+  return width;
+}
+
+// Pass 1: append the WHITE runs of rows [v0, v1) to rt, uniting
+// connected runs of consecutive rows.
+// (Does not update the instrumentation counters: it may run in threads.)
+static void ExtractRuns(const Image img, uint32 v0, uint32 v1, RunTable *rt)
+{
+  uint32 prev = (uint32)rt->count, prev_end = prev;
+  for (uint32 v = v0; v < v1; v++)
+  {
+    uint32 cur = (uint32)rt->count;
+    uint32 u = 0;
+    if (img->depth == 1)
+    {
+      const uint8 *row = ImageRowBytes(img, v);
+      while (u < img->width)
+      {
+        uint32 u0 = skipBits(row, u, img->width, 1);
+        u = skipBits(row, u0, img->width, 0);
+        if (u > u0)
+          RunTablePush(rt, v, u0, u);
+      }
+    }
+    else if (img->depth == 8)
+    {
+      const uint8 *row = ImageRow8(img, v);
+      while (u < img->width)
+      {
+        // Same as below, with 8-bit labels
+        while (u < img->width && row[u] != WHITE)
+          u++;
+        uint32 u0 = u;
+        while (u < img->width && row[u] == WHITE)
+          u++;
+        if (u > u0)
+          RunTablePush(rt, v, u0, u);
+      }
+    }
+    else
+    {
+      const uint16 *row = ImageRow(img, v);
+      while (u < img->width)
+      {
+        // Skip non-WHITE pixels, then measure the WHITE run
+        while (u < img->width && row[u] != WHITE)
+          u++;
+        uint32 u0 = u;
+        while (u < img->width && row[u] == WHITE)
+          u++;
+        if (u > u0)
+          RunTablePush(rt, v, u0, u);
+      }
+    }
+    uint32 cur_end = (uint32)rt->count;
+    RunUniteRows(rt->runs, prev, prev_end, cur, cur_end);
+    prev = cur;
+    prev_end = cur_end;
+  }
+}
+
+// Pass 2a: give each region a new label, in raster order of the regions'
+// first runs, following the color sequence of ImageSegmentation.
+// Returns the number of regions.
+static int LabelRuns(Image img, RunTable *rt)
+{
+  int regions = 0;
+  rgb_t color = GenerateNextColor(0);
+  for (size_t i = 0; i < rt->count; i++)
+  {
+    uint32 root = RunFind(rt->runs, (uint32)i);
+    if (root == i)
+    {
+      regions++;
+      color = GenerateNextColor(color);
+      rt->runs[i].label = LUTAllocColor(img, color);
+    }
+    else
+    {
+      rt->runs[i].label = rt->runs[root].label;
+    }
+  }
+  return regions;
+}
+
+// Pass 2b: paint the runs [first, last) with their region labels.
+static void PaintRuns(Image img, const Run *runs, size_t first, size_t last)
+{
+  for (size_t i = first; i < last; i++)
+  {
+    const Run *r = &runs[i];
+    PixelSetSpan(img, r->v, r->u0, r->u1, r->label);
+    COUNT(PIXWRITES, r->u1 - r->u0);
+  }
+}
+
+/// Label each WHITE region with a different color, like ImageSegmentation,
+/// using two-pass run-based union-find labelling.
+/// Produces the same labels and LUT as ImageSegmentation, without flood
+/// filling and without allocating anything per region.
+///
+/// Returns the number of image regions found.
+int ImageSegmentationUnionFind(Image img)
+{
+  assert(img != NULL);
+  assert(img->base == NULL); // see ImageMaterialize
+  InvalidateFingerprint(img);
+
+  RunTable rt;
+  RunTableInit(&rt, 2 * (size_t)img->height);
+  ExtractRuns(img, 0, img->height, &rt);
+  COUNT(PIXREADS, (unsigned long)img->width * img->height);
+  COUNT(PIXVALIDATIONS, (unsigned long)img->width * img->height);
+  int regions = LabelRuns(img, &rt);
+  PaintRuns(img, rt.runs, 0, rt.count);
+  RunTableFree(&rt);
+
+  return regions;
+}
+
+/// Parallel union-find segmentation
+
+// The image is split into horizontal bands of rows, one per thread.
+// Each phase below runs all the bands in parallel, with serial steps
+// in between:
+//   1. Each band extracts and unites its own runs (ExtractRuns), then
+//      points every run directly to its band-local root.
+//   -  The band tables are placed one after the other (raster order).
+//   2. Each band copies its runs to the merged table, fixing the indices.
+//   -  Runs that touch across band borders are united.
+//   3. Each band counts the regions whose first run is in the band,
+//      numbering them (in raster order) in the label field of those runs.
+//   -  Regions get consecutive labels from the LUT, in the same order as
+//      in ImageSegmentation.
+//   4. Each band paints its runs.
+// Only the serial steps write to shared data, so no locks are needed.
+
+// Upper limit for the number of threads
+#define SEGMENTATION_MAX_THREADS 256
+
+#if defined(__linux__) || defined(__APPLE__)
+
+#include <unistd.h>
+
+// Number of online processors (at least 1).
+static int OnlineProcessors(void)
+{
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return ncpus > 0 ? (int)ncpus : 1;
+}
+
+#else
+
+static int OnlineProcessors(void)
+{
+  return 1;
+}
+
+#endif
+
+// The state of one band
+typedef struct
+{
+  Image img;
+  uint32 v0, v1;          // rows [v0, v1) of this band
+  RunTable rt;            // runs of the band (phase 1)
+  Run *runs;              // the merged table of all bands (phases 2-4)
+  size_t offset;          // index of the first run of the band in runs
+  size_t count;           // number of runs of the band
+  size_t first_row_end;   // the runs of row v0 are [offset, first_row_end)
+  size_t last_row_begin;  // the runs of row v1-1 are [last_row_begin, offset+count)
+  uint32 new_regions;     // regions whose first run is in this band
+  uint32 first_region;    // index of the first of those regions (phase 4)
+  const uint16 *region_label; // label of each region (phase 4)
+  const void *bands;      // all bands, to locate roots in other bands
+  int nbands;
+  unsigned long painted;  // pixels painted (phase 4)
+  int phase;
+} SegBand;
+
+// Find the band that contains run i.
+static const SegBand *SegBandOfRun(const SegBand *bands, int nbands, size_t i)
+{
+  int lo = 0, hi = nbands - 1;
+  while (lo < hi)
+  {
+    int mid = (lo + hi + 1) / 2;
+    if (bands[mid].offset <= i)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return &bands[lo];
+}
+
+static void *SegBandWork(void *arg)
+{
+  SegBand *band = arg;
+  switch (band->phase)
+  {
+  case 1:
+  {
+    RunTableInit(&band->rt, 2 * (size_t)(band->v1 - band->v0));
+    ExtractRuns(band->img, band->v0, band->v1, &band->rt);
+    // Parents precede their runs: one forward pass flattens every tree
+    Run *runs = band->rt.runs;
+    for (size_t i = 0; i < band->rt.count; i++)
+      runs[i].parent = runs[runs[i].parent].parent;
+    band->count = band->rt.count;
+    break;
+  }
+  case 2:
+  {
+    Run *dst = band->runs + band->offset;
+    memcpy(dst, band->rt.runs, band->count * sizeof(Run));
+    for (size_t i = 0; i < band->count; i++)
+      dst[i].parent += (uint32)band->offset;
+    RunTableFree(&band->rt);
+    break;
+  }
+  case 3:
+  {
+    // Roots are runs whose parent is themselves
+    Run *runs = band->runs;
+    uint32 n = 0;
+    for (size_t i = band->offset; i < band->offset + band->count; i++)
+    {
+      if (runs[i].parent == i)
+        runs[i].label = (uint16)n++;
+    }
+    band->new_regions = n;
+    break;
+  }
+  case 4:
+  {
+    // Read-only find: other threads read the same trees concurrently
+    const Run *runs = band->runs;
+    unsigned long painted = 0;
+    for (size_t i = band->offset; i < band->offset + band->count; i++)
+    {
+      uint32 root = runs[i].parent;
+      while (runs[root].parent != root)
+        root = runs[root].parent;
+      const SegBand *owner = SegBandOfRun(band->bands, band->nbands, root);
+      uint16 label = band->region_label[owner->first_region + runs[root].label];
+      PixelSetSpan(band->img, runs[i].v, runs[i].u0, runs[i].u1, label);
+      painted += runs[i].u1 - runs[i].u0;
+    }
+    band->painted = painted;
+    break;
+  }
+  }
+  return NULL;
+}
+
+// Run one phase of all bands: bands 1.. in new threads, band 0 in this one.
+static void SegBandsRun(SegBand *bands, int nbands, int phase)
+{
+  pthread_t threads[SEGMENTATION_MAX_THREADS];
+  for (int b = 0; b < nbands; b++)
+    bands[b].phase = phase;
+  for (int b = 1; b < nbands; b++)
+    check(pthread_create(&threads[b], NULL, SegBandWork, &bands[b]) == 0, "pthread_create");
+  SegBandWork(&bands[0]);
+  for (int b = 1; b < nbands; b++)
+    check(pthread_join(threads[b], NULL) == 0, "pthread_join");
+}
+
+/// Label each WHITE region with a different color, like
+/// ImageSegmentationUnionFind, using nthreads threads.
+/// If nthreads <= 0, one thread per online processor is used.
+///
+/// Returns the number of image regions found.
+int ImageSegmentationParallel(Image img, int nthreads)
+{
+  assert(img != NULL);
+  assert(img->base == NULL); // see ImageMaterialize
+  InvalidateFingerprint(img);
+
+  if (nthreads <= 0)
+    nthreads = OnlineProcessors();
+  if (nthreads > SEGMENTATION_MAX_THREADS)
+    nthreads = SEGMENTATION_MAX_THREADS;
+  if ((uint32)nthreads > img->height)
+    nthreads = (int)img->height;
+
+  SegBand *bands = calloc((size_t)nthreads, sizeof(SegBand));
+  // Error handling
+  check(bands != NULL, "Alloc failed ->bands array");
+  for (int b = 0; b < nthreads; b++)
+  {
+    bands[b].img = img;
+    bands[b].v0 = (uint32)((uint64_t)img->height * b / nthreads);
+    bands[b].v1 = (uint32)((uint64_t)img->height * (b + 1) / nthreads);
+    bands[b].bands = bands;
+    bands[b].nbands = nthreads;
+  }
+
+  // Phase 1: runs of each band
+  SegBandsRun(bands, nthreads, 1);
+
+  // Place the bands one after the other
+  size_t total = 0;
+  for (int b = 0; b < nthreads; b++)
+  {
+    bands[b].offset = total;
+    total += bands[b].count;
+  }
+  check(total < UINT32_MAX, "Too many runs");
+  Run *runs = malloc((total > 0 ? total : 1) * sizeof(Run));
+  // Error handling
+  check(runs != NULL, "Alloc failed ->runs array");
+  for (int b = 0; b < nthreads; b++)
+    bands[b].runs = runs;
+
+  // Phase 2: merged run table
+  SegBandsRun(bands, nthreads, 2);
+
+  // Unite the runs that touch across band borders
+  for (int b = 0; b < nthreads; b++)
+  {
+    SegBand *band = &bands[b];
+    size_t end = band->offset + band->count;
+    band->first_row_end = band->offset;
+    while (band->first_row_end < end && runs[band->first_row_end].v == band->v0)
+      band->first_row_end++;
+    band->last_row_begin = end;
+    while (band->last_row_begin > band->offset && runs[band->last_row_begin - 1].v == band->v1 - 1)
+      band->last_row_begin--;
+  }
+  for (int b = 1; b < nthreads; b++)
+  {
+    SegBand *above = &bands[b - 1];
+    SegBand *below = &bands[b];
+    size_t prev = above->last_row_begin, prev_end = above->offset + above->count;
+    size_t cur = below->offset, cur_end = below->first_row_end;
+    while (prev < prev_end && cur < cur_end)
+    {
+      if (runs[prev].u1 > runs[cur].u0 && runs[cur].u1 > runs[prev].u0)
+        RunUnion(runs, (uint32)prev, (uint32)cur);
+      if (runs[prev].u1 < runs[cur].u1)
+        prev++;
+      else
+        cur++;
+    }
+  }
+
+  // Phase 3: number the new regions of each band
+  SegBandsRun(bands, nthreads, 3);
+
+  // Allocate the region labels, in raster order
+  uint32 regions = 0;
+  for (int b = 0; b < nthreads; b++)
+  {
+    bands[b].first_region = regions;
+    regions += bands[b].new_regions;
+  }
+  check(regions < LUT_MAX_COLORS, "LUT Overflow");
+  uint16 *region_label = malloc((regions > 0 ? regions : 1) * sizeof(uint16));
+  // Error handling
+  check(region_label != NULL, "Alloc failed ->region_label array");
+  rgb_t color = GenerateNextColor(0);
+  for (uint32 r = 0; r < regions; r++)
+  {
+    color = GenerateNextColor(color);
+    region_label[r] = LUTAllocColor(img, color);
+  }
+  for (int b = 0; b < nthreads; b++)
+    bands[b].region_label = region_label;
+
+  // Phase 4: paint
+  SegBandsRun(bands, nthreads, 4);
+
+  COUNT(PIXREADS, (unsigned long)img->width * img->height);
+  COUNT(PIXVALIDATIONS, (unsigned long)img->width * img->height);
+  for (int b = 0; b < nthreads; b++)
+    COUNT(PIXWRITES, bands[b].painted);
+
+  free(region_label);
+  free(runs);
+  free(bands);
+
+  return (int)regions;
+}
+
+/// Run-length encoded images
+
+// An RLE image stores each row as a list of maximal runs of pixels with
+// the same label. The runs of row v are runs[row_start[v] .. row_start[v+1])
+// and they cover [0, width) from left to right, so each run only needs
+// its end column (it starts where the previous run ends).
+// The LUT is kept in an image header without pixels, so the usual LUT
+// functions (and LabelRuns) work on it.
+
+// A run of pixels with the same label, ending (exclusive) at column u1.
+typedef struct
+{
+  uint32 u1;
+  uint16 label;
+} LabelRun;
+
+struct imageRLE
+{
+  uint32 width;
+  uint32 height;
+  size_t *row_start; // height+1 indices into runs
+  LabelRun *runs;    // the runs of all rows, in raster order
+  size_t count;      // number of runs
+  size_t capacity;   // number of runs allocated
+  Image palette;     // header (without pixels) that holds the LUT
+};
+
+// Allocate a width x height RLE image with no runs,
+// and a copy of the LUT of lut_img.
+static ImageRLE AllocateRLE(uint32 width, uint32 height, const Image lut_img)
+{
+  ImageRLE rle = malloc(sizeof(struct imageRLE));
+  // Error handling
+  check(rle != NULL, "malloc");
+  rle->width = width;
+  rle->height = height;
+  rle->row_start = calloc((size_t)height + 1, sizeof(size_t));
+  rle->capacity = 2 * (size_t)height + 16;
+  rle->runs = malloc(rle->capacity * sizeof(LabelRun));
+  // Error handling
+  check(rle->row_start != NULL && rle->runs != NULL, "Alloc failed ->RLE runs");
+  rle->count = 0;
+
+  rle->palette = AllocateImageHeader(width, height);
+  LUTReserve(rle->palette, lut_img->num_colors);
+  for (uint16 i = 0; i < lut_img->num_colors; i++)
+    LUTAllocColor(rle->palette, lut_img->LUT[i]);
+  return rle;
+}
+
+// Append a run that ends at column u1 with the given label.
+static inline void RLEPush(ImageRLE rle, uint32 u1, uint16 label)
+{
+  if (rle->count == rle->capacity)
+  {
+    rle->capacity *= 2;
+    LabelRun *runs = realloc(rle->runs, rle->capacity * sizeof(LabelRun));
+    // Error handling
+    check(runs != NULL, "Alloc failed ->RLE runs");
+    rle->runs = runs;
+  }
+  rle->runs[rle->count].u1 = u1;
+  rle->runs[rle->count].label = label;
+  rle->count++;
+}
+
+/// Create the RLE version of img.
+/// (The caller is responsible for destroying the returned RLE image!)
+ImageRLE ImageRLECreate(const Image img)
+{
+  assert(img != NULL);
+
+  ImageRLE rle = AllocateRLE(img->width, img->height, ImageBase(img));
+  uint16 *labels = AllocateLabelRow(img);
+  for (uint32 v = 0; v < img->height; v++)
+  {
+    rle->row_start[v] = rle->count;
+    uint32 u = 0;
+    if (img->depth == 1 && img->base == NULL)
+    {
+      // Runs of equal bits, skipping whole bytes at once
+      const uint8 *row = ImageRowBytes(img, v);
+      while (u < img->width)
+      {
+        uint16 label = PixelGet(img, u, v);
+        u = skipBits(row, u, img->width, label);
+        RLEPush(rle, u, label);
+      }
+    }
+    else
+    {
+      const uint16 *row = ImageRowLabels(img, v, labels);
+      while (u < img->width)
+      {
+        uint16 label = row[u];
+        while (u < img->width && row[u] == label)
+          u++;
+        RLEPush(rle, u, label);
+      }
+    }
+  }
+  rle->row_start[img->height] = rle->count;
+  free(labels);
+  return rle;
+}
+
+/// Create the image represented by rle.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageRLEToImage(const ImageRLE rle)
+{
+  assert(rle != NULL);
+
+  Image img = AllocateImageHeader(rle->width, rle->height);
+  const Image palette = rle->palette;
+  LUTReserve(img, palette->num_colors);
+  for (uint16 i = 0; i < palette->num_colors; i++)
+    LUTAllocColor(img, palette->LUT[i]);
+  AllocatePixels(img);
+
+  for (uint32 v = 0; v < rle->height; v++)
+  {
+    uint32 u0 = 0;
+    for (size_t i = rle->row_start[v]; i < rle->row_start[v + 1]; i++)
+    {
+      // The pixel block starts WHITE
+      if (rle->runs[i].label != WHITE)
+        PixelSetSpan(img, v, u0, rle->runs[i].u1, rle->runs[i].label);
+      u0 = rle->runs[i].u1;
+    }
+  }
+  return img;
+}
+
+/// Destroy the RLE image pointed to by (*rlep).
+/// If (*rlep)==NULL, no operation is performed.
+///
+/// Ensures: (*rlep)==NULL.
+void ImageRLEDestroy(ImageRLE *rlep)
+{
+  assert(rlep != NULL);
+
+  ImageRLE rle = *rlep;
+  if (rle == NULL)
+    return;
+
+  free(rle->row_start);
+  free(rle->runs);
+  ImageDestroy(&rle->palette);
+  free(rle);
+
+  *rlep = NULL;
+}
+
+/// Get the number of runs of rle
+size_t ImageRLERuns(const ImageRLE rle)
+{
+  assert(rle != NULL);
+  return rle->count;
+}
+
+/// Get number of colors of rle
+uint16 ImageRLEColors(const ImageRLE rle)
+{
+  assert(rle != NULL);
+  return rle->palette->num_colors;
+}
+
+/// Check if rle1 and rle2 represent equal images.
+/// The runs of each row are merged, comparing the colors of overlapping
+/// runs: the cost is proportional to the number of runs.
+int ImageRLEIsEqual(const ImageRLE rle1, const ImageRLE rle2)
+{
+  assert(rle1 != NULL);
+  assert(rle2 != NULL);
+
+  if (rle1 == rle2)
+    return 1;
+  if (rle1->width != rle2->width || rle1->height != rle2->height)
+    return 0;
+
+  const rgb_t *LUT1 = rle1->palette->LUT;
+  const rgb_t *LUT2 = rle2->palette->LUT;
+  for (uint32 v = 0; v < rle1->height; v++)
+  {
+    size_t i = rle1->row_start[v], j = rle2->row_start[v];
+    size_t i_end = rle1->row_start[v + 1], j_end = rle2->row_start[v + 1];
+    while (i < i_end && j < j_end)
+    {
+      COUNT(LUTREADS, 2);
+      if (LUT1[rle1->runs[i].label] != LUT2[rle2->runs[j].label])
+        return 0;
+      // Advance the run that ends first (or both)
+      uint32 u1 = rle1->runs[i].u1, u2 = rle2->runs[j].u1;
+      if (u1 <= u2)
+        i++;
+      if (u2 <= u1)
+        j++;
+    }
+  }
+  return 1;
+}
+
+/// Rotate rle 180 degrees clockwise (CW).
+/// Returns a rotated version of rle: each row is the reversed list of
+/// runs of the opposite row.
+/// (The caller is responsible for destroying the returned RLE image!)
+ImageRLE ImageRLERotate180CW(const ImageRLE rle)
+{
+  assert(rle != NULL);
+
+  ImageRLE new_rle = AllocateRLE(rle->width, rle->height, rle->palette);
+  for (uint32 v = 0; v < rle->height; v++)
+  {
+    uint32 src_v = rle->height - 1 - v;
+    size_t first = rle->row_start[src_v];
+    new_rle->row_start[v] = new_rle->count;
+    // Run i of the source starts at the end of run i-1 (or at 0)
+    for (size_t i = rle->row_start[src_v + 1]; i > first; i--)
+    {
+      uint32 u0 = i - 1 > first ? rle->runs[i - 2].u1 : 0;
+      RLEPush(new_rle, rle->width - u0, rle->runs[i - 1].label);
+    }
+  }
+  new_rle->row_start[rle->height] = new_rle->count;
+  return new_rle;
+}
+
+/// Save rle to PBM file.
+/// Requires: rle has 2 colors (WHITE and BLACK).
+/// On success, returns nonzero.
+/// On failure, a partial and invalid file may be left in the system.
+int ImageRLESavePBM(const ImageRLE rle, const char *filename)
+{
+  assert(rle != NULL);
+  assert(rle->palette->num_colors == 2);
+
+  PNMWriter writer;
+  PNMWriterOpen(&writer, filename);
+  PNMPrintf(&writer, "P4\n%d %d\n", (int)rle->width, (int)rle->height);
+
+  // Each row is packed by setting the bits of its BLACK runs
+  size_t nbytes = ((size_t)rle->width + 8 - 1) / 8;
+  uint8 *bytes = malloc(nbytes);
+  // Error handling
+  check(bytes != NULL, "Alloc failed ->row buffer");
+  for (uint32 v = 0; v < rle->height; v++)
+  {
+    memset(bytes, 0, nbytes);
+    uint32 u0 = 0;
+    for (size_t i = rle->row_start[v]; i < rle->row_start[v + 1]; i++)
+    {
+      if (rle->runs[i].label != WHITE)
+        setBitSpan(bytes, u0, rle->runs[i].u1, 1);
+      u0 = rle->runs[i].u1;
+    }
+    // (Rows wider than the buffer are written in pieces)
+    for (size_t b0 = 0; b0 < nbytes; b0 += PNM_BUFFER_SIZE)
+    {
+      size_t n = nbytes - b0 < PNM_BUFFER_SIZE ? nbytes - b0 : PNM_BUFFER_SIZE;
+      memcpy(PNMReserve(&writer, n), bytes + b0, n);
+      writer.len += n;
+    }
+  }
+
+  // Cleanup
+  free(bytes);
+  PNMWriterClose(&writer);
+
+  return 1;
+}
+
+/// Label each WHITE region of rle with a different color, like
+/// ImageSegmentation, with union-find on the WHITE runs of rle.
+/// Runs are labelled in place: the cost depends on the number of runs,
+/// not on the number of pixels.
+///
+/// Returns the number of image regions found.
+int ImageRLESegmentation(ImageRLE rle)
+{
+  assert(rle != NULL);
+
+  // Pass 1: unite the WHITE runs of consecutive rows
+  RunTable rt;
+  RunTableInit(&rt, rle->count);
+  uint32 prev = 0, prev_end = 0;
+  for (uint32 v = 0; v < rle->height; v++)
+  {
+    uint32 cur = (uint32)rt.count;
+    uint32 u0 = 0;
+    for (size_t i = rle->row_start[v]; i < rle->row_start[v + 1]; i++)
+    {
+      if (rle->runs[i].label == WHITE)
+        RunTablePush(&rt, v, u0, rle->runs[i].u1);
+      u0 = rle->runs[i].u1;
+    }
+    uint32 cur_end = (uint32)rt.count;
+    RunUniteRows(rt.runs, prev, prev_end, cur, cur_end);
+    prev = cur;
+    prev_end = cur_end;
+  }
+  // The same counters as ImageSegmentationUnionFind, but the unit here
+  // is a run of rle (which is what is read, tested and written)
+  COUNT(PIXREADS, rle->count);
+  COUNT(PIXVALIDATIONS, rle->count);
+
+  // Pass 2: label the regions, and copy the labels back to the WHITE
+  // runs of rle (in the same raster order)
+  int regions = LabelRuns(rle->palette, &rt);
+  size_t k = 0;
+  for (size_t i = 0; i < rle->count; i++)
+  {
+    if (rle->runs[i].label == WHITE)
+      rle->runs[i].label = rt.runs[k++].label;
+  }
+  assert(k == rt.count);
+  COUNT(PIXREADS, rle->count);
+  COUNT(PIXVALIDATIONS, rle->count);
+  COUNT(PIXWRITES, rt.count);
+  RunTableFree(&rt);
+
+  return regions;
+}
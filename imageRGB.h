@@ -14,6 +14,7 @@
 #define IMAGERGB_H
 
 #include <inttypes.h>
+#include <stddef.h>
 
 // Types for non-negative integer values
 typedef uint8_t uint8;
@@ -26,6 +27,9 @@ typedef uint32 rgb_t;
 // Type Image is a pointer to image objects
 typedef struct image* Image;
 
+// Type ImageRLE is a pointer to run-length encoded image objects
+typedef struct imageRLE* ImageRLE;
+
 // The LUT indices for the BLACK and WHITE pixels
 // WHITE pixels are background pixels in a non-segmented image
 // BLACK pixels are contour pixels
@@ -96,17 +100,24 @@ int ImageSavePBM(const Image img, const char* filename);
 
 /// PPM file operations --- For RGB images
 
-/// Load a raw PPM file.
-/// Only ASCII PPM files are accepted.
+/// Load a PPM file.
+/// Both ASCII (P3) and binary (P6) PPM files are accepted.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 Image ImageLoadPPM(const char* filename);
 
-/// Save image to PPM file.
+/// Save image to PPM file (ASCII, P3).
 /// On success, returns nonzero.
 /// On failure, a partial and invalid file may be left in the system.
 int ImageSavePPM(const Image img, const char* filename);
 
+/// Save image to a binary PPM file (P6).
+/// Binary files are about 4 times smaller, and much faster to write and
+/// to load (with ImageLoadPPM), than ASCII files.
+/// On success, returns nonzero.
+/// On failure, a partial and invalid file may be left in the system.
+int ImageSavePPMBinary(const Image img, const char* filename);
+
 /// Information queries
 
 /// These functions do not modify the image and never fail.
@@ -131,6 +142,14 @@ int ImageIsEqual(const Image img1, const Image img2);
 
 int ImageIsDifferent(const Image img1, const Image img2);
 
+/// Compute (once) and return the fingerprint of img: a hash of the
+/// colors of its pixels, by position, kept until img changes.
+/// ImageIsEqual rejects two images at once when both have fingerprints
+/// that differ; otherwise it compares the pixels. Compute fingerprints
+/// for images that will be compared many times (e.g., to deduplicate).
+/// img must not be a view (see ImageMaterialize).
+uint64_t ImageFingerprint(Image img);
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -155,6 +174,95 @@ Image ImageRotate90CW(const Image img);
 /// (The caller is responsible for destroying the returned image!)
 Image ImageRotate180CW(const Image img);
 
+/// Rotate 270 degrees clockwise (CW), i.e., 90 degrees counterclockwise.
+/// Returns a rotated version of the image.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageRotate270CW(const Image img);
+
+/// Transpose: pixel (u, v) of the new image is pixel (v, u) of img.
+/// Returns a transposed version of the image.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageTranspose(const Image img);
+
+/// In-place geometric transformations
+
+/// These functions transform the pixels of img itself, without a second
+/// copy of the image, so that images that only fit in memory once can
+/// still be rotated.  The LUT is not changed.
+
+/// Flip horizontally (mirror left-right), in place.
+/// Pixel (u, v) moves to (W-1-u, v).
+void ImageFlipHorizontal(Image img);
+
+/// Flip vertically (mirror top-bottom), in place.
+/// Pixel (u, v) moves to (u, H-1-v).
+void ImageFlipVertical(Image img);
+
+/// Rotate 180 degrees clockwise (CW), in place.
+/// Same result as ImageRotate180CW, without allocating a new image.
+void ImageRotate180CWInPlace(Image img);
+
+/// Rotate 90 degrees clockwise (CW), in place.
+/// Same result as ImageRotate90CW, without allocating a new image:
+/// square images are rotated in cycles of 4 pixels; other images are
+/// transposed in tiles of 8x8 pixels, with scratch memory for a few rows,
+/// and their pixel block may grow by the padding of the new rows.
+/// A non-square img must have no views, whose dimensions would no longer
+/// match it: that is checked.
+void ImageRotate90CWInPlace(Image img);
+
+/// Image views
+
+/// A view shows another image (its base) in a different orientation,
+/// without copying any pixels: e.g., comparing a view of a rotation
+/// with another image costs one pass over the pixels, instead of one
+/// pass to rotate and another to compare.
+///
+/// A view shares the pixels and the LUT of its base, which must outlive
+/// it; changes to the base show through the view.  Views can be
+/// queried, compared (ImageIsEqual), saved (ImageSavePBM, ImageSavePPM,
+/// ImageSavePPMBinary), converted (ImageRLECreate), copied or rotated
+/// (which materialises them), and filled: a fill of a view paints the
+/// same region of its base.  Other operations (segmentation and the
+/// in-place transformations) need a real image: see ImageMaterialize.
+///
+/// A view takes the dimensions of its base when it is created, so the
+/// base must keep its shape while it has views: ImageRotate90CWInPlace
+/// of a non-square base with views fails (and exits the program), and
+/// the views must be destroyed first.  In-place transformations that keep
+/// the shape (flips, 180 degree and square rotations) are allowed.
+
+/// Orientation of a view: bit 0 flips u, bit 1 flips v, and bit 2 then
+/// swaps the axes. Pixel (u, v) of a view with orientation
+/// ORIENT_ROTATE90CW is pixel (u, v) of ImageRotate90CW(base), etc.
+typedef enum
+{
+  ORIENT_IDENTITY = 0,
+  ORIENT_FLIP_HORIZONTAL = 1,
+  ORIENT_FLIP_VERTICAL = 2,
+  ORIENT_ROTATE180 = 3,
+  ORIENT_TRANSPOSE = 4,
+  ORIENT_ROTATE90CW = 5,
+  ORIENT_ROTATE270CW = 6,
+  ORIENT_ANTITRANSPOSE = 7,
+} Orientation;
+
+/// Create a view of img with the given orientation.
+/// If img is itself a view, the new view shows its base, with both
+/// orientations combined.
+/// (The caller is responsible for destroying the returned view!)
+Image ImageView(const Image img, Orientation orientation);
+
+/// Create a new image with the pixels of img, which may be a view.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageMaterialize(const Image img);
+
 /// Check whether pixel coords (u, v) are inside img.
 /// ATTENTION
 ///   u : column index
@@ -163,7 +271,7 @@ int ImageIsValidPixel(const Image img, int u, int v);
 
 /// Region Growing
 
-/// The following three *RegionFilling* functions perform region growing
+/// The following four *RegionFilling* functions perform region growing
 /// using some variation of the 4-neighbors flood-filling algorithm:
 ///   Given the coordinates (u, v) of a seed pixel,
 ///   fill all similarly-colored adjacent pixels with a new color label.
@@ -188,9 +296,51 @@ int ImageRegionFillingWithSTACK(Image img, int u, int v, uint16 label);
 /// implement the flood-filling algorithm.
 int ImageRegionFillingWithQUEUE(Image img, int u, int v, uint16 label);
 
+/// Region growing using the scanline (span-based) flood-filling algorithm.
+/// Whole horizontal spans are filled at once and a STACK keeps only one
+/// seed for each run of pixels to fill in the rows above and below.
+int ImageRegionFillingScanline(Image img, int u, int v, uint16 label);
+
 /// Type: Pointer to a region filling function:
 typedef int (*FillingFunction)(Image img, int u, int v, uint16 label);
 
+/// Region growing with a reusable fill context
+
+/// A fill context owns the working storage of a fill (a STACK, a QUEUE
+/// and a visited bitmap). The same context may be used for many fills,
+/// on the same or on other images, so that storage is allocated once
+/// rather than once per fill. A context must not be shared by threads.
+///
+/// The context fills never push the same pixel twice.
+/// They receive the same arguments and return the same result as the
+/// fills above, plus the context as first argument.
+
+/// Type FillContext is a pointer to fill context objects
+typedef struct fillContext* FillContext;
+
+/// Create a fill context, sized for images like img.
+/// (It grows automatically if used on larger images.)
+/// (The caller is responsible for destroying the returned context!)
+FillContext FillContextCreate(const Image img);
+
+/// Destroy the fill context pointed to by (*ctxp).
+/// If (*ctxp)==NULL, no operation is performed.
+///
+/// Ensures: (*ctxp)==NULL.
+void FillContextDestroy(FillContext* ctxp);
+
+/// Region growing using the STACK of the fill context.
+int ImageRegionFillingWithSTACKCtx(FillContext ctx, Image img, int u, int v, uint16 label);
+
+/// Region growing using the QUEUE of the fill context.
+int ImageRegionFillingWithQUEUECtx(FillContext ctx, Image img, int u, int v, uint16 label);
+
+/// Region growing using the scanline algorithm and the fill context.
+int ImageRegionFillingScanlineCtx(FillContext ctx, Image img, int u, int v, uint16 label);
+
+/// Type: Pointer to a region filling function that uses a fill context:
+typedef int (*FillingFunctionCtx)(FillContext ctx, Image img, int u, int v, uint16 label);
+
 /// Image Segmentation
 
 /// Label each WHITE region with a different color.
@@ -203,4 +353,73 @@ typedef int (*FillingFunction)(Image img, int u, int v, uint16 label);
 /// Returns the number of image regions found.
 int ImageSegmentation(Image img, FillingFunction fillFunct);
 
+/// Label each WHITE region with a different color, like ImageSegmentation,
+/// using one of the context fills above.
+/// All regions are filled with the given fill context, so no storage
+/// is allocated per region.
+///
+/// Returns the number of image regions found.
+int ImageSegmentationWithContext(Image img, FillContext ctx, FillingFunctionCtx fillFunct);
+
+/// Label each WHITE region with a different color, without flood filling.
+/// Uses two-pass union-find labelling of the horizontal runs of WHITE
+/// pixels, and produces the same region labels and LUT colors as
+/// ImageSegmentation.
+///
+/// Returns the number of image regions found.
+int ImageSegmentationUnionFind(Image img);
+
+/// Label each WHITE region with a different color, like
+/// ImageSegmentationUnionFind, splitting the image into horizontal bands
+/// that are labelled by nthreads threads, and merging the labels across
+/// band borders. The result is the same as with ImageSegmentation.
+///   nthreads: the number of threads (<= 0: one per online processor).
+///
+/// Returns the number of image regions found.
+int ImageSegmentationParallel(Image img, int nthreads);
+
+/// Run-length encoded images
+
+/// An RLE image stores each row as a list of runs of pixels with the
+/// same label (and has its own LUT). Images made of long runs, like
+/// mazes and masks, need far less memory this way, and the operations
+/// below take time proportional to the number of runs.
+
+/// Create the RLE version of img.
+/// (The caller is responsible for destroying the returned RLE image!)
+ImageRLE ImageRLECreate(const Image img);
+
+/// Create the image represented by rle.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageRLEToImage(const ImageRLE rle);
+
+/// Destroy the RLE image pointed to by (*rlep).
+/// If (*rlep)==NULL, no operation is performed.
+///
+/// Ensures: (*rlep)==NULL.
+void ImageRLEDestroy(ImageRLE* rlep);
+
+/// Get the number of runs of rle
+size_t ImageRLERuns(const ImageRLE rle);
+
+/// Get number of colors of rle
+uint16 ImageRLEColors(const ImageRLE rle);
+
+/// Check if rle1 and rle2 represent equal images.
+int ImageRLEIsEqual(const ImageRLE rle1, const ImageRLE rle2);
+
+/// Rotate 180 degrees clockwise (CW).
+/// (The caller is responsible for destroying the returned RLE image!)
+ImageRLE ImageRLERotate180CW(const ImageRLE rle);
+
+/// Save a 2-color (WHITE and BLACK) RLE image to a PBM file.
+/// On success, returns nonzero.
+int ImageRLESavePBM(const ImageRLE rle, const char* filename);
+
+/// Label each WHITE region with a different color, like
+/// ImageSegmentationUnionFind, working directly on the runs.
+///
+/// Returns the number of image regions found.
+int ImageRLESegmentation(ImageRLE rle);
+
 #endif
@@ -11,9 +11,12 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 // Assumindo que estes ficheiros existem no ambiente de compilação
 #include "error.h"
@@ -30,6 +33,22 @@
 int global_passed_count = 0;
 int global_total_count = 0;
 
+// Verifica se carregar filename termina o programa com um erro (check),
+// e não com uma asserção: o carregamento corre num processo filho.
+static int LoadFails(Image (*load)(const char *), const char *filename) {
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == 0) {
+        freopen("/dev/null", "w", stderr);
+        Image img = load(filename);
+        ImageDestroy(&img);
+        _exit(0);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid) return 0;
+    return WIFEXITED(status) && WEXITSTATUS(status) != 0;
+}
+
 // --- Macro para Verificação de Testes, Contagem e Coloração ---
 // Recebe ponteiros para os contadores locais de passados e total
 #define ASSERT_CHECK(condition, test_name, passed_count_ptr, total_count_ptr) \
@@ -53,6 +72,7 @@ static void TestImageInformationAndComparison(int section_num);
 static void TestImageGeometricTransformations(int section_num);
 static void TestImageRegionFillingAndSegmentation(int section_num);
 static void TestImageIsValidPixelFunction(int section_num);
+static void* FillInThread(void* arg);
 
 int main(int argc, char* argv[]) {
     program_name = argv[0];
@@ -127,7 +147,7 @@ static void TestImageCreationAndManagement(int section_num) {
     // 1.6 - ImageCreatePalete
     printf("1.6: ImageCreatePalete (32x32, edge 8)\n");
     image_palete = ImageCreatePalete(32, 32, 8);
-    // 32/8 = 4 tiles wide, 4 tiles high. 16 cores (ou FIXED_LUT_SIZE se for menor)
+    // 32/8 = 4 tiles wide, 4 tiles high. LUT com as 1000 cores geradas
     int check1_6 = (image_palete != NULL && ImageWidth(image_palete) == 32 && ImageHeight(image_palete) == 32 && ImageColors(image_palete) == 1000);
     ASSERT_CHECK(check1_6, "ImageCreatePalete_Small", &local_passed_count, &local_total_count);
     
@@ -182,6 +202,18 @@ static void TestImageFileIO(int section_num) {
     printf("2.4: ImageSavePPM (palete -> test_palete.ppm)\n");
     ASSERT_CHECK(ImageSavePPM(image_palete, "test_palete.ppm") == 1, "ImageSavePPM_Palete_Success", &local_passed_count, &local_total_count);
 
+    // 2.4b - Formato exato do texto gerado por ImageSavePPM
+    printf("2.4b: ImageSavePPM (exact output format)\n");
+    Image tiny = ImageCreateChess(2, 1, 1, 0xff0000);
+    ImageSavePPM(tiny, "test_tiny.ppm");
+    char tiny_text[128] = {0};
+    FILE* f_tiny = fopen("test_tiny.ppm", "rb");
+    size_t tiny_len = fread(tiny_text, 1, sizeof(tiny_text) - 1, f_tiny);
+    fclose(f_tiny);
+    const char* tiny_expected = "P3\n2 1\n255\n  255   0   0  255 255 255\n";
+    ASSERT_CHECK(tiny_len == strlen(tiny_expected) && strcmp(tiny_text, tiny_expected) == 0, "ImageSavePPM_ExactFormat", &local_passed_count, &local_total_count);
+    ImageDestroy(&tiny);
+
     // 2.5 - ImageLoadPPM
     printf("2.5: ImageLoadPPM (test_chess_red.ppm)\n");
     loaded_ppm_chess = ImageLoadPPM("test_chess_red.ppm");
@@ -192,6 +224,8 @@ static void TestImageFileIO(int section_num) {
     loaded_ppm_palete = ImageLoadPPM("test_palete.ppm");
     int check2_6 = (loaded_ppm_palete != NULL && ImageIsEqual(image_palete, loaded_ppm_palete));
     ASSERT_CHECK(check2_6, "ImageLoadPPM_Palete_Verify", &local_passed_count, &local_total_count);
+    // 4x4 ladrilhos = 16 cores, cada uma alocada uma única vez na LUT
+    ASSERT_CHECK(loaded_ppm_palete != NULL && ImageColors(loaded_ppm_palete) == 16, "ImageLoadPPM_Palete_Colors", &local_passed_count, &local_total_count);
 
     // 2.7 - Teste com ficheiros externos (assumindo img/feep.pbm e img/feep.ppm existem)
     printf("2.7: ImageLoadPBM (img/feep.pbm)\n");
@@ -202,6 +236,91 @@ static void TestImageFileIO(int section_num) {
     image_ppm_load = ImageLoadPPM("img/feep.ppm");
     ASSERT_CHECK(image_ppm_load != NULL, "ImageLoadPPM_External", &local_passed_count, &local_total_count);
 
+    // 2.9 - ImageLoadPPM com comentários e espaços arbitrários
+    printf("2.9: ImageLoadPPM (comments, tabs, CRLF, leading zeros)\n");
+    FILE* f_plain = fopen("test_plain.ppm", "w");
+    fprintf(f_plain, "P3\n3 2\n255\n255 0 0  0 255 0  0 0 255\n7 8 9  255 255 255  0 0 0\n");
+    fclose(f_plain);
+    FILE* f_tricky = fopen("test_tricky.ppm", "w");
+    fprintf(f_tricky, "P3 # magic\r\n#comment\n 3\t2 # dims\n255\n255 0 0 0 255 0\r\n0 0 00255 # more\n\t7\n8 9 255 255 255 0 0 0");
+    fclose(f_tricky);
+    Image img_plain = ImageLoadPPM("test_plain.ppm");
+    Image img_tricky = ImageLoadPPM("test_tricky.ppm");
+    ASSERT_CHECK(ImageIsEqual(img_plain, img_tricky) && ImageColors(img_tricky) == 6, "ImageLoadPPM_Tokenizer", &local_passed_count, &local_total_count);
+    ImageDestroy(&img_plain);
+    ImageDestroy(&img_tricky);
+
+    // 2.10 - Ficheiro maior do que o buffer de leitura
+    printf("2.10: ImageLoadPPM (400x400 palete, larger than the read buffer)\n");
+    Image big_palete = ImageCreatePalete(400, 400, 10);
+    ImageSavePPM(big_palete, "test_big_palete.ppm");
+    Image big_loaded = ImageLoadPPM("test_big_palete.ppm");
+    ASSERT_CHECK(ImageIsEqual(big_palete, big_loaded), "ImageLoadPPM_Big", &local_passed_count, &local_total_count);
+    ImageDestroy(&big_palete);
+    ImageDestroy(&big_loaded);
+
+    // 2.11 - PPM binário (P6)
+    printf("2.11: ImageSavePPMBinary / ImageLoadPPM (P6)\n");
+    Image p6_palete = ImageCreatePalete(300, 200, 10);
+    int check2_11 = ImageSavePPMBinary(p6_palete, "test_palete_p6.ppm") == 1 &&
+                    ImageSavePPMBinary(image_chess_red, "test_chess_red_p6.ppm") == 1;
+    Image p6_palete_loaded = ImageLoadPPM("test_palete_p6.ppm");
+    Image p6_chess_loaded = ImageLoadPPM("test_chess_red_p6.ppm");
+    check2_11 = check2_11 && ImageIsEqual(p6_palete, p6_palete_loaded) && ImageIsEqual(image_chess_red, p6_chess_loaded);
+    ASSERT_CHECK(check2_11, "ImagePPM_Binary_RoundTrip", &local_passed_count, &local_total_count);
+    ImageDestroy(&p6_palete);
+    ImageDestroy(&p6_palete_loaded);
+    ImageDestroy(&p6_chess_loaded);
+
+    // 2.12 - ImageLoadPBM: comentários no cabeçalho e bits de padding ignorados
+    printf("2.12: ImageLoadPBM (comments, padding bits set)\n");
+    FILE* f_pbm = fopen("test_padding.pbm", "wb");
+    fprintf(f_pbm, "P4 # magic\n#comment\n3 2\n");
+    fputc(0xBF, f_pbm); // 101 + padding 11111
+    fputc(0x40, f_pbm); // 010 + padding 00000
+    fclose(f_pbm);
+    FILE* f_ppm = fopen("test_padding.ppm", "w");
+    fprintf(f_ppm, "P3\n3 2\n255\n0 0 0 255 255 255 0 0 0\n255 255 255 0 0 0 255 255 255\n");
+    fclose(f_ppm);
+    Image pbm_padding = ImageLoadPBM("test_padding.pbm");
+    Image ppm_padding = ImageLoadPPM("test_padding.ppm");
+    Image wide_chess = ImageCreateChess(1001, 77, 3, 0x000000);
+    ImageSavePBM(wide_chess, "test_wide_chess.pbm");
+    Image wide_loaded = ImageLoadPBM("test_wide_chess.pbm");
+    ASSERT_CHECK(ImageIsEqual(pbm_padding, ppm_padding) && ImageIsEqual(wide_chess, wide_loaded), "ImageLoadPBM_Padding", &local_passed_count, &local_total_count);
+    ImageDestroy(&pbm_padding);
+    ImageDestroy(&ppm_padding);
+    ImageDestroy(&wide_chess);
+    ImageDestroy(&wide_loaded);
+
+    // 2.13 - ImageSavePBM: bytes exatos, incluindo bits de padding a 0
+    printf("2.13: ImageSavePBM (exact bytes, zero padding bits)\n");
+    Image pbm_rows = ImageCreateChess(21, 2, 1, 0x000000);
+    ImageSavePBM(pbm_rows, "test_padding.pbm");
+    const unsigned char expected_pbm[] = "P4\n21 2\n\xAA\xAA\xA8\x55\x55\x50";
+    unsigned char saved_pbm[sizeof(expected_pbm)];
+    f_pbm = fopen("test_padding.pbm", "rb");
+    size_t saved_len = fread(saved_pbm, 1, sizeof(saved_pbm), f_pbm);
+    fclose(f_pbm);
+    ASSERT_CHECK(saved_len == sizeof(expected_pbm) - 1 && memcmp(saved_pbm, expected_pbm, saved_len) == 0, "ImageSavePBM_Bytes", &local_passed_count, &local_total_count);
+    ImageDestroy(&pbm_rows);
+
+    // 2.14 - Dimensões nulas são rejeitadas como ficheiros inválidos
+    printf("2.14: ImageLoadPBM / ImageLoadPPM (zero width or height)\n");
+    f_pbm = fopen("test_zero_width.pbm", "wb");
+    fprintf(f_pbm, "P4\n0 3\n");
+    fclose(f_pbm);
+    f_pbm = fopen("test_zero_height.pbm", "wb");
+    fprintf(f_pbm, "P4\n3 0\n");
+    fclose(f_pbm);
+    f_ppm = fopen("test_zero_width.ppm", "w");
+    fprintf(f_ppm, "P3\n0 2\n255\n");
+    fclose(f_ppm);
+    ASSERT_CHECK(LoadFails(ImageLoadPBM, "test_zero_width.pbm") &&
+                 LoadFails(ImageLoadPBM, "test_zero_height.pbm") &&
+                 LoadFails(ImageLoadPPM, "test_zero_width.ppm"),
+                 "ImageLoad_ZeroSize", &local_passed_count, &local_total_count);
+
     // Cleanup
     ImageDestroy(&image_chess_black);
     ImageDestroy(&image_chess_red);
@@ -249,6 +368,56 @@ static void TestImageInformationAndComparison(int section_num) {
     ASSERT_CHECK(ImageIsDifferent(img_A, img_E), "ImageIsDifferent_A_E", &local_passed_count, &local_total_count);
     ASSERT_CHECK(!ImageIsDifferent(img_A, img_B), "ImageIsDifferent_A_B (Should be Equal)", &local_passed_count, &local_total_count);
 
+    // 3.4 - Imagem a preto e branco vs. imagem com mais cores (com os mesmos pixels)
+    printf("3.4: ImageIsEqual (black and white vs. 3-color image)\n");
+    Image img_bw = ImageCreateChess(6, 3, 3, 0x000000);
+    Image img_red = ImageCreateChess(6, 3, 3, 0xff0000);
+    int check3_4 = !ImageIsEqual(img_bw, img_red);
+    ImageRegionFillingWithSTACK(img_red, 0, 0, 1); // pinta o quadrado vermelho de BLACK
+    check3_4 = check3_4 && ImageIsEqual(img_bw, img_red) && ImageIsEqual(img_red, img_bw);
+    ASSERT_CHECK(check3_4, "ImageIsEqual_BlackAndWhite_3Colors", &local_passed_count, &local_total_count);
+    ImageDestroy(&img_bw);
+    ImageDestroy(&img_red);
+
+    // 3.5 - Mesmas cores com labels diferentes nas duas LUTs
+    printf("3.5: ImageIsEqual (same colors, different labels)\n");
+    FILE* f_rgw = fopen("test_plain.ppm", "w");
+    fprintf(f_rgw, "P3\n3 1\n255\n255 0 0 255 255 255 0 255 0\n");
+    fclose(f_rgw);
+    Image img_rwg = ImageLoadPPM("test_plain.ppm"); // LUT: W, B, red, green
+    f_rgw = fopen("test_plain.ppm", "w");
+    fprintf(f_rgw, "P3\n3 1\n255\n0 255 0 255 255 255 255 0 0\n");
+    fclose(f_rgw);
+    Image img_gwr = ImageLoadPPM("test_plain.ppm"); // LUT: W, B, green, red
+    int check3_5 = !ImageIsEqual(img_rwg, img_gwr);
+    ImageRegionFillingScanline(img_gwr, 0, 0, 3); // red
+    ImageRegionFillingScanline(img_gwr, 2, 0, 2); // green
+    check3_5 = check3_5 && ImageIsEqual(img_rwg, img_gwr) && ImageIsEqual(img_gwr, img_rwg);
+    ASSERT_CHECK(check3_5, "ImageIsEqual_TranslatedLabels", &local_passed_count, &local_total_count);
+    ImageDestroy(&img_rwg);
+    ImageDestroy(&img_gwr);
+
+    // 3.6 - A impressão digital (fingerprint) é invalidada quando a imagem muda
+    // (calculada explicitamente antes de cada comparação)
+    printf("3.6: ImageIsEqual after the images change (cached fingerprints)\n");
+    Image fp_a = ImageCreateChess(64, 48, 4, 0x000000);
+    Image fp_b = ImageCopy(fp_a);
+    int check3_6 = ImageIsEqual(fp_a, fp_b) && ImageFingerprint(fp_a) == ImageFingerprint(fp_b);
+    ImageRegionFillingScanline(fp_b, 4, 0, BLACK); // um quadrado branco
+    check3_6 = check3_6 && ImageFingerprint(fp_a) != ImageFingerprint(fp_b) && !ImageIsEqual(fp_a, fp_b);
+    ImageRegionFillingScanline(fp_a, 4, 0, BLACK);
+    ImageFingerprint(fp_a);
+    check3_6 = check3_6 && ImageIsEqual(fp_a, fp_b);
+    ImageSegmentationUnionFind(fp_a);
+    ImageFingerprint(fp_a);
+    check3_6 = check3_6 && !ImageIsEqual(fp_a, fp_b);
+    ImageSegmentation(fp_b, &ImageRegionFillingWithQUEUE);
+    ImageFingerprint(fp_b);
+    check3_6 = check3_6 && ImageIsEqual(fp_a, fp_b);
+    ASSERT_CHECK(check3_6, "ImageIsEqual_FingerprintInvalidation", &local_passed_count, &local_total_count);
+    ImageDestroy(&fp_a);
+    ImageDestroy(&fp_b);
+
     // Cleanup
     ImageDestroy(&img_A);
     ImageDestroy(&img_B);
@@ -294,6 +463,189 @@ static void TestImageGeometricTransformations(int section_num) {
     int check4_3 = (ImageIsEqual(img_180CW, img_90CW_twice));
     ASSERT_CHECK(check4_3, "ImageRotate_Equivalence", &local_passed_count, &local_total_count);
 
+    // 4.4 - Largura que não é múltipla do alinhamento das linhas (stride)
+    printf("4.4: ImageRotate90CW x4 == original (37x23)\n");
+    Image img_odd = ImageCreatePalete(37, 23, 3);
+    Image img_r1 = ImageRotate90CW(img_odd);
+    Image img_r2 = ImageRotate90CW(img_r1);
+    Image img_r3 = ImageRotate90CW(img_r2);
+    Image img_r4 = ImageRotate90CW(img_r3);
+    Image img_odd_copy = ImageCopy(img_odd);
+    int check4_4 = (ImageIsEqual(img_odd, img_r4) && ImageIsEqual(img_odd_copy, img_r4) && !ImageIsEqual(img_odd, img_r2));
+    ASSERT_CHECK(check4_4, "ImageRotate_OddWidth_FullTurn", &local_passed_count, &local_total_count);
+    ImageDestroy(&img_odd);
+    ImageDestroy(&img_r1);
+    ImageDestroy(&img_r2);
+    ImageDestroy(&img_r3);
+    ImageDestroy(&img_r4);
+    ImageDestroy(&img_odd_copy);
+
+    // 4.5 - Imagens a preto e branco (1 bit por pixel)
+    printf("4.5: ImageRotate90CW / ImageRotate180CW (black and white, 37x23)\n");
+    Image img_bw = ImageCreateChess(37, 23, 2, 0x000000);
+    Image img_bw_r1 = ImageRotate90CW(img_bw);
+    Image img_bw_r2 = ImageRotate90CW(img_bw_r1);
+    Image img_bw_180 = ImageRotate180CW(img_bw);
+    Image img_bw_360 = ImageRotate180CW(img_bw_180);
+    Image img_bw_r3 = ImageRotate90CW(img_bw_r2);
+    Image img_bw_r4 = ImageRotate90CW(img_bw_r3);
+    int check4_5 = (ImageWidth(img_bw_r1) == 23 && ImageHeight(img_bw_r1) == 37 &&
+                    ImageIsEqual(img_bw_r2, img_bw_180) && ImageIsEqual(img_bw, img_bw_360) &&
+                    ImageIsEqual(img_bw, img_bw_r4) && !ImageIsEqual(img_bw, img_bw_180));
+    ASSERT_CHECK(check4_5, "ImageRotate_BlackAndWhite", &local_passed_count, &local_total_count);
+    ImageDestroy(&img_bw);
+    ImageDestroy(&img_bw_r1);
+    ImageDestroy(&img_bw_r2);
+    ImageDestroy(&img_bw_r3);
+    ImageDestroy(&img_bw_r4);
+    ImageDestroy(&img_bw_180);
+    ImageDestroy(&img_bw_360);
+
+    // 4.6 - Imagens RLE: conversão, rotação de 180 graus, igualdade e PBM
+    printf("4.6: ImageRLE (round trip, ImageRLERotate180CW, ImageRLESavePBM)\n");
+    Image rle_maze = ImageLoadPBM("img/maze41x41.pbm");
+    Image rle_maze_180 = ImageRotate180CW(rle_maze);
+    ImageRLE rle = ImageRLECreate(rle_maze);
+    ImageRLE rle_180 = ImageRLERotate180CW(rle);
+    ImageRLE rle_360 = ImageRLERotate180CW(rle_180);
+    Image rle_back = ImageRLEToImage(rle);
+    Image rle_180_back = ImageRLEToImage(rle_180);
+    ImageRLESavePBM(rle_180, "test_rotated_180CW.pbm");
+    Image rle_180_loaded = ImageLoadPBM("test_rotated_180CW.pbm");
+    ImageRLE rle_palete = ImageRLECreate(img_original);
+    Image rle_palete_back = ImageRLEToImage(rle_palete);
+    int check4_6 = ImageRLERuns(rle) < 41 * 41 / 2 && ImageRLEColors(rle) == 2 &&
+                   ImageIsEqual(rle_back, rle_maze) && ImageIsEqual(rle_180_back, rle_maze_180) &&
+                   ImageIsEqual(rle_180_loaded, rle_maze_180) &&
+                   ImageRLEIsEqual(rle, rle_360) && !ImageRLEIsEqual(rle, rle_180) &&
+                   ImageIsEqual(rle_palete_back, img_original);
+    ASSERT_CHECK(check4_6, "ImageRLE_RoundTrip_Rotate180", &local_passed_count, &local_total_count);
+    ImageRLEDestroy(&rle);
+    ImageRLEDestroy(&rle_180);
+    ImageRLEDestroy(&rle_360);
+    ImageRLEDestroy(&rle_palete);
+    ImageDestroy(&rle_maze);
+    ImageDestroy(&rle_maze_180);
+    ImageDestroy(&rle_back);
+    ImageDestroy(&rle_180_back);
+    ImageDestroy(&rle_180_loaded);
+    ImageDestroy(&rle_palete_back);
+
+    // 4.7 - Rotação de 270 graus e transposição, com 16, 8 e 1 bit(s) por pixel
+    // (a transposição de uma rotação de 90 graus é uma reflexão vertical, que
+    // é a rotação de 180 graus da transposição de uma rotação de 270 graus)
+    printf("4.7: ImageRotate270CW / ImageTranspose (16, 8 and 1 bits per pixel)\n");
+    Image imgs4_7[3] = {ImageCreatePalete(100, 50, 10),
+                        ImageCreateChess(37, 23, 2, 0xff0000),
+                        ImageCreateChess(37, 23, 2, 0x000000)};
+    int check4_7 = 1;
+    for (int i = 0; i < 3; i++)
+    {
+      Image r90 = ImageRotate90CW(imgs4_7[i]);
+      Image r270 = ImageRotate270CW(imgs4_7[i]);
+      Image r360 = ImageRotate270CW(r90);
+      Image r180 = ImageRotate180CW(imgs4_7[i]);
+      Image r270_again = ImageRotate90CW(r180);
+      Image t = ImageTranspose(imgs4_7[i]);
+      Image tt = ImageTranspose(t);
+      Image t90 = ImageTranspose(r90);
+      Image t270 = ImageTranspose(r270);
+      Image t270_180 = ImageRotate180CW(t270);
+      check4_7 = check4_7 && ImageWidth(t) == ImageHeight(imgs4_7[i]) &&
+                 ImageHeight(t) == ImageWidth(imgs4_7[i]) &&
+                 ImageIsEqual(r360, imgs4_7[i]) && ImageIsEqual(r270, r270_again) &&
+                 ImageIsEqual(tt, imgs4_7[i]) && ImageIsEqual(t90, t270_180) &&
+                 !ImageIsEqual(t, r90) && !ImageIsEqual(t, r270);
+      ImageDestroy(&r90);
+      ImageDestroy(&r270);
+      ImageDestroy(&r360);
+      ImageDestroy(&r180);
+      ImageDestroy(&r270_again);
+      ImageDestroy(&t);
+      ImageDestroy(&tt);
+      ImageDestroy(&t90);
+      ImageDestroy(&t270);
+      ImageDestroy(&t270_180);
+      ImageDestroy(&imgs4_7[i]);
+    }
+    ASSERT_CHECK(check4_7, "ImageRotate270_Transpose", &local_passed_count, &local_total_count);
+
+    // 4.8 - Transformações in-place: iguais às que criam uma nova imagem
+    // (imagens não quadradas e quadradas, com 16, 8 e 1 bit(s) por pixel)
+    printf("4.8: ImageRotate90CWInPlace / ImageRotate180CWInPlace / ImageFlip*\n");
+    Image imgs4_8[4] = {ImageCreatePalete(100, 50, 10),
+                        ImageCreateChess(37, 23, 2, 0xff0000),
+                        ImageCreateChess(37, 23, 2, 0x000000),
+                        ImageCreateChess(30, 30, 4, 0xff0000)};
+    int check4_8 = 1;
+    for (int i = 0; i < 4; i++)
+    {
+      Image r90 = ImageRotate90CW(imgs4_8[i]);
+      Image r180 = ImageRotate180CW(imgs4_8[i]);
+      Image in_place = ImageCopy(imgs4_8[i]);
+      ImageRotate90CWInPlace(in_place);
+      check4_8 = check4_8 && ImageIsEqual(in_place, r90);
+      ImageRotate90CWInPlace(in_place);
+      check4_8 = check4_8 && ImageIsEqual(in_place, r180);
+      ImageRotate180CWInPlace(in_place);
+      check4_8 = check4_8 && ImageIsEqual(in_place, imgs4_8[i]);
+      ImageFlipHorizontal(in_place);
+      ImageFlipVertical(in_place);
+      check4_8 = check4_8 && ImageIsEqual(in_place, r180);
+      ImageDestroy(&r90);
+      ImageDestroy(&r180);
+      ImageDestroy(&in_place);
+      ImageDestroy(&imgs4_8[i]);
+    }
+    ASSERT_CHECK(check4_8, "ImageRotate_InPlace", &local_passed_count, &local_total_count);
+
+    // 4.9 - Vistas orientadas: comparação, composição, gravação e preenchimento
+    // sem materializar a rotação
+    printf("4.9: ImageView / ImageMaterialize (orientation views)\n");
+    Image view_base = ImageCreateChess(37, 23, 4, 0xff0000);
+    Image view_r90 = ImageRotate90CW(view_base);
+    Image view_r180 = ImageRotate180CW(view_base);
+    Image view90 = ImageView(view_base, ORIENT_ROTATE90CW);
+    Image view180 = ImageView(view90, ORIENT_ROTATE90CW); // vista de uma vista
+    Image view_flips = ImageView(view_base, ORIENT_FLIP_HORIZONTAL);
+    Image view_flips2 = ImageView(view_flips, ORIENT_FLIP_VERTICAL);
+    Image view90_copy = ImageMaterialize(view90);
+    ImageSavePPM(view90, "test_view90.ppm");
+    Image view90_loaded = ImageLoadPPM("test_view90.ppm");
+    int check4_9 = ImageWidth(view90) == 23 && ImageHeight(view90) == 37 &&
+                   ImageColors(view90) == ImageColors(view_base) &&
+                   ImageIsEqual(view90, view_r90) && ImageIsEqual(view_r90, view90) &&
+                   ImageIsEqual(view180, view_r180) && ImageIsEqual(view_flips2, view_r180) &&
+                   !ImageIsEqual(view_flips, view_r180) &&
+                   ImageIsEqual(view90_copy, view_r90) && ImageIsEqual(view90_loaded, view_r90);
+    // Preencher a vista pinta a mesma região da imagem base
+    int painted_view = ImageRegionFillingScanline(view90, 0, 0, 1);
+    int painted_copy = ImageRegionFillingScanline(view90_copy, 0, 0, 1);
+    check4_9 = check4_9 && painted_view > 0 && painted_view == painted_copy &&
+               ImageIsEqual(view90, view90_copy);
+    // Rodar no lugar uma base quadrada mantém as vistas válidas; uma base
+    // não quadrada só pode ser rodada depois de destruir as suas vistas
+    Image square_base = ImageCreateChess(24, 24, 5, 0);
+    Image square_copy = ImageCopy(square_base);
+    Image square_view = ImageView(square_base, ORIENT_ROTATE270CW);
+    ImageRotate90CWInPlace(square_base);
+    check4_9 = check4_9 && ImageIsEqual(square_view, square_copy);
+    ImageDestroy(&square_view);
+    ImageDestroy(&square_copy);
+    ImageDestroy(&square_base);
+    ImageDestroy(&view90);
+    ImageDestroy(&view180);
+    ImageDestroy(&view_flips);
+    ImageDestroy(&view_flips2);
+    ImageRotate90CWInPlace(view_base);
+    check4_9 = check4_9 && ImageIsEqual(view_base, view90_copy);
+    ASSERT_CHECK(check4_9, "ImageView_Orientation", &local_passed_count, &local_total_count);
+    ImageDestroy(&view90_copy);
+    ImageDestroy(&view90_loaded);
+    ImageDestroy(&view_r90);
+    ImageDestroy(&view_r180);
+    ImageDestroy(&view_base);
+
     // Cleanup
     ImageDestroy(&img_original);
     ImageDestroy(&img_90CW);
@@ -339,6 +691,16 @@ static void TestImageRegionFillingAndSegmentation(int section_num) {
     ASSERT_CHECK(count_queue == 64, "ImageRegionFillingWithQUEUE_Count", &local_passed_count, &local_total_count);
     ImageDestroy(&img_queue);
 
+    // 5.3b - ImageRegionFillingScanline
+    printf("5.3b: ImageRegionFillingScanline\n");
+    Image img_scan = ImageCopy(img_base);
+    int count_scan = ImageRegionFillingScanline(img_scan, 10, 7, BLACK);
+    Image img_scan_ref = ImageCopy(img_base);
+    ImageRegionFillingWithSTACK(img_scan_ref, 10, 7, BLACK);
+    ASSERT_CHECK(count_scan == 64 && ImageIsEqual(img_scan, img_scan_ref), "ImageRegionFillingScanline_Count", &local_passed_count, &local_total_count);
+    ImageDestroy(&img_scan);
+    ImageDestroy(&img_scan_ref);
+
     // 5.4 - ImageSegmentation (usando RECURSIVE)
     printf("5.4: ImageSegmentation (with RECURSIVE filling)\n");
     Image img_seg_rec = ImageCopy(img_base);
@@ -364,6 +726,175 @@ static void TestImageRegionFillingAndSegmentation(int section_num) {
     ASSERT_CHECK(check5_6, "ImageSegmentation_Queue_RegionsCount", &local_passed_count, &local_total_count);
     ImageDestroy(&img_seg_queue);
 
+    // 5.6b - ImageSegmentation (usando SCANLINE) no labirinto
+    printf("5.6b: ImageSegmentation (with SCANLINE filling, img/maze41x41.pbm)\n");
+    Image maze_stack = ImageLoadPBM("img/maze41x41.pbm");
+    Image maze_scan = ImageCopy(maze_stack);
+    int regions_maze_stack = ImageSegmentation(maze_stack, &ImageRegionFillingWithSTACK);
+    int regions_maze_scan = ImageSegmentation(maze_scan, &ImageRegionFillingScanline);
+    int check5_6b = (regions_maze_scan == regions_maze_stack && ImageIsEqual(maze_stack, maze_scan));
+    ASSERT_CHECK(check5_6b, "ImageSegmentation_Scanline_SameAsStack", &local_passed_count, &local_total_count);
+    ImageDestroy(&maze_stack);
+    ImageDestroy(&maze_scan);
+
+    // 5.7 - ImageSegmentation com mais regiões do que as 1000 cores antigas
+    printf("5.7: ImageSegmentation (400x400, edge 5 -> 3200 regions)\n");
+    Image img_many = ImageCreateChess(400, 400, 5, 0x000000);
+    int regions_many = ImageSegmentation(img_many, &ImageRegionFillingWithSTACK);
+    int check5_7 = (regions_many == 3200 && ImageColors(img_many) == 2 + 3200);
+    ASSERT_CHECK(check5_7, "ImageSegmentation_ManyRegions_LUTGrowth", &local_passed_count, &local_total_count);
+    ImageDestroy(&img_many);
+
+    // 5.8 - ImageSegmentationUnionFind deve dar o mesmo resultado que a versão com STACK
+    printf("5.8: ImageSegmentationUnionFind == ImageSegmentation (STACK)\n");
+    Image uf_bases[3];
+    uf_bases[0] = ImageCopy(img_base);
+    uf_bases[1] = ImageLoadPBM("img/maze41x41.pbm");
+    uf_bases[2] = ImageCreateChess(400, 400, 5, 0x000000);
+    int check5_8 = 1;
+    for (int i = 0; i < 3; i++) {
+        Image img_uf = ImageCopy(uf_bases[i]);
+        int regions_ref = ImageSegmentation(uf_bases[i], &ImageRegionFillingWithSTACK);
+        int regions_uf = ImageSegmentationUnionFind(img_uf);
+        check5_8 = check5_8 && regions_uf == regions_ref &&
+                   ImageColors(img_uf) == ImageColors(uf_bases[i]) &&
+                   ImageIsEqual(img_uf, uf_bases[i]);
+        ImageDestroy(&img_uf);
+        ImageDestroy(&uf_bases[i]);
+    }
+    ASSERT_CHECK(check5_8, "ImageSegmentationUnionFind_SameAsStack", &local_passed_count, &local_total_count);
+
+    // 5.9 - Preenchimento e segmentação com um contexto reutilizável
+    printf("5.9: Region filling and segmentation with a FillContext\n");
+    Image img_ctx = ImageCopy(img_base);
+    FillContext ctx = FillContextCreate(img_ctx);
+    int count_ctx_stack = ImageRegionFillingWithSTACKCtx(ctx, img_ctx, 10, 7, BLACK);
+    int count_ctx_queue = ImageRegionFillingWithQUEUECtx(ctx, img_ctx, 0, 8, BLACK);
+    int count_ctx_scan = ImageRegionFillingScanlineCtx(ctx, img_ctx, 16, 8, BLACK);
+    ASSERT_CHECK(count_ctx_stack == 64 && count_ctx_queue == 64 && count_ctx_scan == 32, "ImageRegionFillingCtx_Counts", &local_passed_count, &local_total_count);
+    ImageDestroy(&img_ctx);
+
+    FillingFunctionCtx ctx_fills[3] = { &ImageRegionFillingWithSTACKCtx, &ImageRegionFillingWithQUEUECtx, &ImageRegionFillingScanlineCtx };
+    int check5_9 = 1;
+    for (int i = 0; i < 3; i++) {
+        Image maze_ref = ImageLoadPBM("img/maze41x41.pbm");
+        Image maze_ctx = ImageCopy(maze_ref);
+        Image chess_ref = ImageCreateChess(400, 400, 5, 0x000000);
+        Image chess_ctx = ImageCopy(chess_ref);
+        // O mesmo contexto é usado em imagens de dimensões diferentes
+        int r_maze = ImageSegmentationWithContext(maze_ctx, ctx, ctx_fills[i]);
+        int r_chess = ImageSegmentationWithContext(chess_ctx, ctx, ctx_fills[i]);
+        check5_9 = check5_9 &&
+                   r_maze == ImageSegmentation(maze_ref, &ImageRegionFillingWithSTACK) &&
+                   r_chess == ImageSegmentation(chess_ref, &ImageRegionFillingWithSTACK) &&
+                   ImageIsEqual(maze_ctx, maze_ref) && ImageIsEqual(chess_ctx, chess_ref);
+        ImageDestroy(&maze_ref);
+        ImageDestroy(&maze_ctx);
+        ImageDestroy(&chess_ref);
+        ImageDestroy(&chess_ctx);
+    }
+    FillContextDestroy(&ctx);
+    ASSERT_CHECK(check5_9 && ctx == NULL, "ImageSegmentationWithContext_SameAsStack", &local_passed_count, &local_total_count);
+
+    // 5.10 - ImageSegmentationParallel: mesmo resultado para qualquer número de threads
+    printf("5.10: ImageSegmentationParallel == ImageSegmentationUnionFind\n");
+    int thread_counts[] = { 1, 2, 3, 7, 64, 0 };
+    int check5_10 = 1;
+    for (int i = 0; i < 3; i++) {
+        Image par_base = (i == 0) ? ImageLoadPBM("img/maze41x41.pbm")
+                       : (i == 1) ? ImageCreateChess(400, 300, 7, 0x000000)
+                                  : ImageCreate(33, 90);
+        Image par_ref = ImageCopy(par_base);
+        int regions_ref = ImageSegmentationUnionFind(par_ref);
+        for (int t = 0; t < 6; t++) {
+            Image par_img = ImageCopy(par_base);
+            int regions_par = ImageSegmentationParallel(par_img, thread_counts[t]);
+            check5_10 = check5_10 && regions_par == regions_ref &&
+                        ImageColors(par_img) == ImageColors(par_ref) &&
+                        ImageIsEqual(par_img, par_ref);
+            ImageDestroy(&par_img);
+        }
+        ImageDestroy(&par_ref);
+        ImageDestroy(&par_base);
+    }
+    ASSERT_CHECK(check5_10, "ImageSegmentationParallel_SameAsUnionFind", &local_passed_count, &local_total_count);
+
+    // 5.11 - Mais de 256 cores durante a segmentação (labels de 8 para 16 bits)
+    printf("5.11: ImageSegmentation past 256 colors (chess_red 200x200, edge 5)\n");
+    Image wide_base = ImageCreateChess(200, 200, 5, 0xff0000);
+    Image wide_fill = ImageCopy(wide_base);
+    Image wide_uf = ImageCopy(wide_base);
+    int check5_11 = ImageSegmentation(wide_fill, &ImageRegionFillingScanline) == 800 &&
+                    ImageSegmentationUnionFind(wide_uf) == 800 &&
+                    ImageColors(wide_fill) == 803 && ImageIsEqual(wide_fill, wide_uf);
+    ImageSavePPM(wide_fill, "test_region_fill_stack.ppm");
+    Image wide_loaded = ImageLoadPPM("test_region_fill_stack.ppm");
+    check5_11 = check5_11 && ImageIsEqual(wide_loaded, wide_uf) && ImageIsDifferent(wide_base, wide_uf);
+    ASSERT_CHECK(check5_11, "ImageSegmentation_Past256Colors", &local_passed_count, &local_total_count);
+    ImageDestroy(&wide_base);
+    ImageDestroy(&wide_fill);
+    ImageDestroy(&wide_uf);
+    ImageDestroy(&wide_loaded);
+
+    // 5.12 - Segmentação de imagens RLE
+    printf("5.12: ImageRLESegmentation == ImageSegmentationUnionFind\n");
+    int check5_12 = 1;
+    for (int i = 0; i < 3; i++) {
+        Image rle_base = (i == 0) ? ImageLoadPBM("img/maze41x41.pbm")
+                       : (i == 1) ? ImageCreateChess(200, 200, 5, 0xff0000)
+                                  : ImageCreate(33, 90);
+        ImageRLE rle_seg = ImageRLECreate(rle_base);
+        int regions_rle = ImageRLESegmentation(rle_seg);
+        int regions_uf = ImageSegmentationUnionFind(rle_base);
+        Image rle_seg_img = ImageRLEToImage(rle_seg);
+        check5_12 = check5_12 && regions_rle == regions_uf &&
+                    ImageRLEColors(rle_seg) == ImageColors(rle_base) &&
+                    ImageIsEqual(rle_seg_img, rle_base);
+        ImageRLEDestroy(&rle_seg);
+        ImageDestroy(&rle_seg_img);
+        ImageDestroy(&rle_base);
+    }
+    ASSERT_CHECK(check5_12, "ImageRLESegmentation_SameAsUnionFind", &local_passed_count, &local_total_count);
+
+    // 5.13 - Contadores por thread: somados, e picos combinados com max
+    printf("5.13: Instrumentation counters merged across threads\n");
+    Image threads_base = ImageLoadPBM("img/maze41x41.pbm");
+    Image threads_img[4];
+    unsigned long serial[NUMCOUNTERS], merged[NUMCOUNTERS];
+    Image serial_img = ImageCopy(threads_base);
+    InstrReset();
+    FillInThread(serial_img);
+    InstrSnapshot(serial);
+    InstrReset();
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) {
+        threads_img[i] = ImageCopy(threads_base);
+        pthread_create(&threads[i], NULL, FillInThread, threads_img[i]);
+    }
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+    InstrSnapshot(merged);
+    int check5_13 = serial[1] > 0 && merged[1] == 4 * serial[1] &&
+                    merged[5] == 4 * serial[5] && merged[7] == serial[7];
+    for (int i = 0; i < 4; i++) {
+        check5_13 = check5_13 && ImageIsEqual(threads_img[i], serial_img);
+        ImageDestroy(&threads_img[i]);
+    }
+    ASSERT_CHECK(check5_13, "Instr_ThreadLocalCounters", &local_passed_count, &local_total_count);
+    ImageDestroy(&serial_img);
+    ImageDestroy(&threads_base);
+
+    // 5.14 - INSTR_CTU sobrepõe a calibração (sem correr o ciclo)
+    printf("5.14: InstrCalibrate with INSTR_CTU override\n");
+    double saved_ctu = InstrCTU;
+    setenv("INSTR_CTU", "0.25", 1);
+    double calibrate_time = cpu_time();
+    InstrCalibrate();
+    calibrate_time = cpu_time() - calibrate_time;
+    unsetenv("INSTR_CTU");
+    ASSERT_CHECK(InstrCTU == 0.25 && calibrate_time < 0.01, "InstrCalibrate_EnvOverride", &local_passed_count, &local_total_count);
+    InstrCTU = saved_ctu;
+
     // Cleanup
     ImageDestroy(&img_base);
 
@@ -372,6 +903,13 @@ static void TestImageRegionFillingAndSegmentation(int section_num) {
            section_num, local_passed_count, local_total_count, local_passed_count, local_total_count);
 }
 
+// Pinta a região do pixel (1,1) com o rótulo 1 (usado no teste 5.13)
+static void* FillInThread(void* arg) {
+    Image img = arg;
+    ImageRegionFillingWithSTACK(img, 1, 1, 1);
+    return NULL;
+}
+
 // --- Seção 6: Testes de Validação de Pixel ---
 static void TestImageIsValidPixelFunction(int section_num) {
     printf("\n## %d. ImageIsValidPixel Test\n", section_num);
@@ -20,12 +20,17 @@
 /// InstrPrint();  // to show time and counters
 
 #include "instrumentation.h"
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
+/// Wall-clock (monotonic) time in seconds
+double wall_time(void) ; ///
+
 #if defined(__linux__) || defined(__APPLE__)
 
 //
@@ -42,6 +47,14 @@ double cpu_time(void) {
   return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
 }
 
+double wall_time(void) {
+  struct timespec current_time;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &current_time) != 0)
+    return -1.0; // clock_gettime() failed!!!
+  return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
+}
+
 #endif
 
 
@@ -66,10 +79,83 @@ double cpu_time(void) {
   return (double)current_time.QuadPart / (double)frequency.QuadPart;
 }
 
+double wall_time(void) {
+  return cpu_time();  // cpu_time() is already measured by the wall clock
+}
+
 #endif
 
-/// Array of operation counters:
-unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Counter block of the calling thread (NULL until its first count).
+_Thread_local InstrBlock* InstrLocalBlock = NULL;  ///extern
+
+/// Array of merge modes for the counters (nonzero: peak, merged with max)
+int InstrPeak[NUMCOUNTERS] = {0};  ///extern
+
+// The registered blocks (of live threads), and the merged counters of
+// the threads that have finished, protected by InstrLock.
+static pthread_mutex_t InstrLock = PTHREAD_MUTEX_INITIALIZER;
+static InstrBlock* InstrBlocks = NULL;
+static unsigned long InstrRetired[NUMCOUNTERS];
+
+// A thread-specific key, whose destructor retires the block of a thread.
+static pthread_key_t InstrKey;
+static pthread_once_t InstrKeyOnce = PTHREAD_ONCE_INIT;
+
+// Merge the counters src into dst.
+static void InstrMerge(unsigned long dst[], const unsigned long src[]) {
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    if (!InstrPeak[i])
+      dst[i] += src[i];
+    else if (src[i] > dst[i])
+      dst[i] = src[i];
+  }
+}
+
+// Merge the block of a finishing thread into InstrRetired, and free it.
+static void InstrRetire(void* arg) {
+  InstrBlock* block = arg;
+  pthread_mutex_lock(&InstrLock);
+  InstrMerge(InstrRetired, block->count);
+  InstrBlock** link = &InstrBlocks;
+  while (*link != block)
+    link = &(*link)->next;
+  *link = block->next;
+  pthread_mutex_unlock(&InstrLock);
+  free(block);
+  InstrLocalBlock = NULL;
+}
+
+static void InstrCreateKey(void) {
+  if (pthread_key_create(&InstrKey, InstrRetire) != 0) {
+    perror("InstrRegister");
+    exit(255);
+  }
+}
+
+/// Create and register the counter block of the calling thread.
+InstrBlock* InstrRegister(void) { ///
+  pthread_once(&InstrKeyOnce, InstrCreateKey);
+  InstrBlock* block = aligned_alloc(_Alignof(InstrBlock), sizeof(InstrBlock));
+  if (block == NULL) {
+    perror("InstrRegister");
+    exit(255);
+  }
+  memset(block, 0, sizeof(InstrBlock));
+  pthread_mutex_lock(&InstrLock);
+  block->next = InstrBlocks;
+  InstrBlocks = block;
+  pthread_mutex_unlock(&InstrLock);
+  pthread_setspecific(InstrKey, block);
+  InstrLocalBlock = block;
+  return block;
+}
+
+unsigned long* InstrCounters(void) { ///
+  InstrBlock* block = InstrLocalBlock;
+  if (block == NULL)
+    block = InstrRegister();
+  return block->count;
+}
 
 /// Array of names for the counters:
 char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
@@ -82,48 +168,350 @@ double InstrTime;  ///extern
 /// Calibrated Time Unit (in seconds, initially 1s)
 double InstrCTU = 1.0;  ///extern
 
-/// Find the Calibrated Time Unit (CTU).
-/// Run and time a loop of basic memory and arithmetic operations to set
-/// a reasonably cpu-independent time unit.
-void InstrCalibrate(void) { ///
-  const int size = 4*1024;     // 2^12!
-  const int mask = size - 1;
-  int array[size];  // alloc array in stack, not initialized on purpose
+// The CTU is the time of CTU_ITERATIONS iterations of the calibration
+// loop. It is estimated as the median of CTU_SAMPLES short runs, scaled:
+// the same loop (so CTUs stay comparable), in a small fraction of the time.
+#define CTU_ITERATIONS 40000000
+#define CTU_SAMPLE 100000
+#define CTU_SAMPLES 9
+
+// Time n iterations of the calibration loop, on array (of mask+1 ints).
+static double InstrCalibrationRun(unsigned array[], int mask, int n) {
   double time = cpu_time();
-  srand((unsigned int)(time*1e9));
-  for (int n = 0; n < 40000000; n++) {
+  for (int k = 0; k < n; k++) {
     int i = rand() & mask;
     int j = rand() & mask;
-    int k = rand() & mask;
-    array[k] ^= array[i] + array[j] + i*j;
-    //printf("%d %d %d\n", i, j, k);  // debug
+    int l = rand() & mask;
+    array[l] ^= array[i] + array[j] + (unsigned)(i*j);
+  }
+  return cpu_time() - time;
+}
+
+static int InstrCompareDoubles(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// Run the calibration loop and return the CTU.
+static double InstrCalibrationMeasure(void) {
+  enum { size = 4*1024 };  // 2^12!
+  unsigned array[size] = {0};
+  srand((unsigned int)(cpu_time()*1e9));
+  InstrCalibrationRun(array, size - 1, CTU_SAMPLE);  // warm up
+  double sample[CTU_SAMPLES];
+  for (int s = 0; s < CTU_SAMPLES; s++)
+    sample[s] = InstrCalibrationRun(array, size - 1, CTU_SAMPLE);
+  qsort(sample, CTU_SAMPLES, sizeof(sample[0]), InstrCompareDoubles);
+  return sample[CTU_SAMPLES / 2] * (CTU_ITERATIONS / CTU_SAMPLE);
+}
+
+#if defined(__linux__) || defined(__APPLE__)
+
+//
+// GNU/Linux and MacOS code for the CTU cache
+//
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Store in key "host/cpu model", the key of this machine in the cache.
+static void InstrCacheKey(char* key, size_t size) {
+  char host[256] = "localhost";
+  char model[256] = "unknown";
+  gethostname(host, sizeof(host) - 1);
+  FILE* f = fopen("/proc/cpuinfo", "r");
+  if (f != NULL) {
+    char line[512];
+    while (fgets(line, sizeof(line), f) != NULL) {
+      char* colon = strchr(line, ':');
+      if (strncmp(line, "model name", 10) == 0 && colon != NULL) {
+        snprintf(model, sizeof(model), "%s", colon + 2);
+        break;
+      }
+    }
+    fclose(f);
+  }
+  snprintf(key, size, "%s/%s", host, model);
+  for (char* c = key; *c != '\0'; c++)  // one line, no tabs
+    if (*c == '\t' || *c == '\n')
+      *c = (c[1] == '\0') ? '\0' : ' ';
+}
+
+// Store in path the cache file: $INSTR_CTU_CACHE, or instr_ctu in
+// $XDG_CACHE_HOME or ~/.cache. Returns 0 if caching is disabled.
+static int InstrCachePath(char* path, size_t size) {
+  const char* env = getenv("INSTR_CTU_CACHE");
+  if (env != NULL) {
+    snprintf(path, size, "%s", env);
+    return env[0] != '\0';
   }
-  InstrCTU = cpu_time() - time;
+  char dir[1024];
+  if ((env = getenv("XDG_CACHE_HOME")) != NULL && env[0] != '\0')
+    snprintf(dir, sizeof(dir), "%s", env);
+  else if ((env = getenv("HOME")) != NULL && env[0] != '\0')
+    snprintf(dir, sizeof(dir), "%s/.cache", env);
+  else
+    return 0;
+  mkdir(dir, 0700);  // may exist already
+  snprintf(path, size, "%s/instr_ctu", dir);
+  return 1;
 }
 
-/// Reset counters to zero and store cpu_time.
+// Look up the CTU of key in the cache file (lines "key\tctu"; the
+// last one wins). Returns 0 if there is none.
+static double InstrCacheLookup(const char* path, const char* key) {
+  FILE* f = fopen(path, "r");
+  if (f == NULL)
+    return 0.0;
+  double ctu = 0.0;
+  char line[1024];
+  size_t len = strlen(key);
+  while (fgets(line, sizeof(line), f) != NULL)
+    if (strncmp(line, key, len) == 0 && line[len] == '\t')
+      ctu = strtod(line + len + 1, NULL);
+  fclose(f);
+  return ctu > 0.0 ? ctu : 0.0;
+}
+
+// Append the CTU of key to the cache file (a single short write, so
+// processes calibrating at the same time do not mix their lines).
+static void InstrCacheStore(const char* path, const char* key, double ctu) {
+  FILE* f = fopen(path, "a");
+  if (f == NULL)
+    return;
+  fprintf(f, "%s\t%.9g\n", key, ctu);
+  fclose(f);
+}
+
+#else
+
+static void InstrCacheKey(char* key, size_t size) { snprintf(key, size, "-"); }
+
+static int InstrCachePath(char* path, size_t size) {
+  (void)path; (void)size;
+  return 0;
+}
+
+static double InstrCacheLookup(const char* path, const char* key) {
+  (void)path; (void)key;
+  return 0.0;
+}
+
+static void InstrCacheStore(const char* path, const char* key, double ctu) {
+  (void)path; (void)key; (void)ctu;
+}
+
+#endif
+
+/// Find the Calibrated Time Unit (CTU).
+/// Use $INSTR_CTU if set, else the value cached for this host and CPU
+/// model, else run and time a loop of basic memory and arithmetic
+/// operations (and cache the result).
+void InstrCalibrate(void) { ///
+  const char* env = getenv("INSTR_CTU");
+  if (env != NULL && strtod(env, NULL) > 0.0) {
+    InstrCTU = strtod(env, NULL);
+    return;
+  }
+  char key[600];
+  char path[1100];
+  InstrCacheKey(key, sizeof(key));
+  int cached = InstrCachePath(path, sizeof(path));
+  double ctu = cached ? InstrCacheLookup(path, key) : 0.0;
+  if (ctu == 0.0) {
+    ctu = InstrCalibrationMeasure();
+    if (cached)
+      InstrCacheStore(path, key, ctu);
+  }
+  InstrCTU = ctu;
+}
+
+/// Names of the hardware counters
+const char* InstrHWName[NUMHWCOUNTERS] = {  ///extern
+  "cycles", "instructions", "l1d_misses",
+  "llc_misses", "branch_misses", "dtlb_misses"
+};
+
+// Start (enable and take a baseline) and stop the hardware counters.
+static void InstrHWStart(void) ;
+static void InstrHWStop(void) ;
+
+#if defined(__linux__)
+
+//
+// GNU/Linux code for the hardware counters
+//
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define HWCACHE(cache) \
+  ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct { unsigned type; unsigned long long config; }
+InstrHWEvent[NUMHWCOUNTERS] = {
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {PERF_TYPE_HW_CACHE, HWCACHE(PERF_COUNT_HW_CACHE_L1D)},
+  {PERF_TYPE_HW_CACHE, HWCACHE(PERF_COUNT_HW_CACHE_LL)},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+  {PERF_TYPE_HW_CACHE, HWCACHE(PERF_COUNT_HW_CACHE_DTLB)},
+};
+
+// One file descriptor per event (-1 if not available), and the values
+// read on the last reset: {count, time enabled, time running}.
+static int InstrHWFd[NUMHWCOUNTERS] = {-1, -1, -1, -1, -1, -1};
+static unsigned long long InstrHWBase[NUMHWCOUNTERS][3];
+
+int InstrHWOpen(void) { ///
+  int n = 0;
+  for (int i = 0; i < NUMHWCOUNTERS; i++) {
+    if (InstrHWFd[i] >= 0) {
+      n++;
+      continue;
+    }
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = InstrHWEvent[i].type;
+    attr.config = InstrHWEvent[i].config;
+    attr.disabled = 1;
+    attr.inherit = 1;  // count the threads created later
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    // Counters are opened separately, not as a group, so that one
+    // missing event does not take the others down.
+    InstrHWFd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (InstrHWFd[i] >= 0)
+      n++;
+  }
+  return n;
+}
+
+// Read {count, time enabled, time running} of counter i.
+static int InstrHWValue(int i, unsigned long long value[3]) {
+  return read(InstrHWFd[i], value, 3 * sizeof(value[0])) ==
+         (ssize_t)(3 * sizeof(value[0]));
+}
+
+// Counts of inherited threads are added on exit, and are not cleared by
+// PERF_EVENT_IOC_RESET, so counts are taken relative to a baseline.
+static void InstrHWStart(void) {
+  for (int i = 0; i < NUMHWCOUNTERS; i++) {
+    if (InstrHWFd[i] < 0)
+      continue;
+    ioctl(InstrHWFd[i], PERF_EVENT_IOC_ENABLE, 0);
+    if (!InstrHWValue(i, InstrHWBase[i]))
+      memset(InstrHWBase[i], 0, sizeof(InstrHWBase[i]));
+  }
+}
+
+static void InstrHWStop(void) {
+  for (int i = 0; i < NUMHWCOUNTERS; i++)
+    if (InstrHWFd[i] >= 0)
+      ioctl(InstrHWFd[i], PERF_EVENT_IOC_DISABLE, 0);
+}
+
+void InstrHWRead(long long values[NUMHWCOUNTERS]) { ///
+  for (int i = 0; i < NUMHWCOUNTERS; i++) {
+    unsigned long long value[3];
+    values[i] = -1;
+    if (InstrHWFd[i] < 0 || !InstrHWValue(i, value))
+      continue;
+    unsigned long long count = value[0] - InstrHWBase[i][0];
+    unsigned long long enabled = value[1] - InstrHWBase[i][1];
+    unsigned long long running = value[2] - InstrHWBase[i][2];
+    if (running == 0)  // never scheduled (or no time elapsed)
+      values[i] = (enabled == 0) ? 0 : -1;
+    else if (running < enabled)  // multiplexed: extrapolate
+      values[i] = (long long)((double)count * enabled / running);
+    else
+      values[i] = (long long)count;
+  }
+}
+
+void InstrHWClose(void) { ///
+  for (int i = 0; i < NUMHWCOUNTERS; i++) {
+    if (InstrHWFd[i] >= 0)
+      close(InstrHWFd[i]);
+    InstrHWFd[i] = -1;
+  }
+}
+
+#else
+
+//
+// Hardware counters are not available elsewhere
+//
+
+int InstrHWOpen(void) { return 0; } ///
+
+static void InstrHWStart(void) {}
+
+static void InstrHWStop(void) {}
+
+void InstrHWRead(long long values[NUMHWCOUNTERS]) { ///
+  for (int i = 0; i < NUMHWCOUNTERS; i++)
+    values[i] = -1;
+}
+
+void InstrHWClose(void) {} ///
+
+#endif
+
+/// Reset counters to zero, store cpu_time and start hardware counters.
 void InstrReset(void) { ///
-  for (int i = 0; i < NUMCOUNTERS; i++)
-    InstrCount[i] = 0ul;
+  pthread_mutex_lock(&InstrLock);
+  memset(InstrRetired, 0, sizeof(InstrRetired));
+  for (InstrBlock* block = InstrBlocks; block != NULL; block = block->next)
+    memset(block->count, 0, sizeof(block->count));
+  pthread_mutex_unlock(&InstrLock);
+  InstrHWStart();
   InstrTime = cpu_time();
 }
 
+/// Store in counts the counters of all threads, merged.
+void InstrSnapshot(unsigned long counts[NUMCOUNTERS]) { ///
+  pthread_mutex_lock(&InstrLock);
+  memcpy(counts, InstrRetired, sizeof(InstrRetired));
+  for (InstrBlock* block = InstrBlocks; block != NULL; block = block->next)
+    InstrMerge(counts, block->count);
+  pthread_mutex_unlock(&InstrLock);
+}
+
 // Print times and all named counter values
 void InstrPrint(void) { ///
   // elapsed time since last reset:
   double time = cpu_time() - InstrTime;
   // compute time in calibrated time units:
   double caltime = time / InstrCTU;
+  unsigned long counts[NUMCOUNTERS];
+  InstrSnapshot(counts);
+  long long hwcounts[NUMHWCOUNTERS];
+  InstrHWRead(hwcounts);
+  InstrHWStop();
 
   printf("#%14.15s\t%15.15s", "time", "caltime");
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
       printf("\t%15.15s", InstrName[i]);
+  for (int i = 0; i < NUMHWCOUNTERS; i++)
+    if (hwcounts[i] >= 0)
+      printf("\t%15.15s", InstrHWName[i]);
   puts("");
   printf("%15.6f\t%15.6f", time, caltime);
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
-      printf("\t%15lu", InstrCount[i]);  
+      printf("\t%15lu", counts[i]);
+  for (int i = 0; i < NUMHWCOUNTERS; i++)
+    if (hwcounts[i] >= 0)
+      printf("\t%15lld", hwcounts[i]);
   puts("");
 }
 
@@ -18,18 +18,53 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time and counters
+///
+/// Each thread counts in its own block of counters (so threads neither
+/// race nor share cache lines). Blocks are registered on first use, and
+/// merged when read, with InstrPrint or InstrSnapshot: counters are
+/// summed, except peak counters (InstrPeak), which take the maximum.
 
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
 
+#include <stddef.h>
+
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
+/// Wall-clock (monotonic) time in seconds
+double wall_time(void) ; ///
+
 /// Ten counters should be more than enough
 #define NUMCOUNTERS 10
 
-/// Array of operation counters:
-extern unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// A block of counters, owned by one thread (a whole cache line or two).
+typedef struct InstrBlock {
+  _Alignas(64) unsigned long count[NUMCOUNTERS];
+  struct InstrBlock* next;  // next registered block
+} InstrBlock;
+
+/// Counter block of the calling thread (NULL until its first count).
+extern _Thread_local InstrBlock* InstrLocalBlock;  ///extern
+
+/// Create and register the counter block of the calling thread.
+InstrBlock* InstrRegister(void) ;
+
+/// Counters of the calling thread (registered on first call).
+/// Not const: the first call allocates and registers a block.
+unsigned long* InstrCounters(void) ;
+
+/// Array of operation counters (of the calling thread):
+///   InstrCount[i] += n;
+/// Once the thread has its block, this only reads InstrLocalBlock;
+/// InstrCounters is called out of line only before that.
+/// To read the counts of all threads, use InstrSnapshot.
+#define InstrCount \
+  (InstrLocalBlock != NULL ? InstrLocalBlock->count : InstrCounters())
+
+/// Array of merge modes for the counters: nonzero for peak counters
+/// (merged with max), zero for the others (merged with +).
+extern int InstrPeak[NUMCOUNTERS];  ///extern
 
 /// Array of names for the counters:
 extern char* InstrName[NUMCOUNTERS];  ///extern
@@ -43,12 +78,43 @@ extern double InstrCTU;  ///extern
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.
+/// The result is cached per host and CPU model (in $INSTR_CTU_CACHE, or
+/// instr_ctu in $XDG_CACHE_HOME or ~/.cache; empty INSTR_CTU_CACHE
+/// disables the cache), and INSTR_CTU=<seconds> overrides it.
 void InstrCalibrate(void) ;
 
-/// Reset counters to zero and store cpu_time.
+/// Reset counters (of all threads) to zero and store cpu_time.
+/// (Call when no other thread is counting.)
 void InstrReset(void) ;
 
+/// Store in counts the counters of all threads, merged, including
+/// those of threads that have finished since the last reset.
+void InstrSnapshot(unsigned long counts[NUMCOUNTERS]) ;
+
 void InstrPrint(void) ;
 
+/// Hardware event counters (Linux perf_event_open), off until opened.
+/// Once InstrHWOpen succeeds, they start on each InstrReset, and stop
+/// on InstrPrint, which prints the available ones after the others.
+#define NUMHWCOUNTERS 6
+
+/// Names of the hardware counters (cycles, instructions, cache misses...)
+extern const char* InstrHWName[NUMHWCOUNTERS];  ///extern
+
+/// Open the hardware counters, for the calling thread and the threads
+/// it creates afterwards (counted when they finish).  Call once, from
+/// the main thread.  Returns how many counters are available: 0 if none
+/// (not Linux, no PMU, as in many VMs, or forbidden by
+/// /proc/sys/kernel/perf_event_paranoid).
+int InstrHWOpen(void) ;
+
+/// Store in values the hardware counts since the last reset (scaled,
+/// if the kernel had to multiplex the counters), or -1 for counters
+/// not available.
+void InstrHWRead(long long values[NUMHWCOUNTERS]) ;
+
+/// Close the hardware counters.
+void InstrHWClose(void) ;
+
 #endif
 
@@ -1,102 +1,447 @@
+#include <math.h>
+#include <regex.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "imageRGB.h"
 #include "instrumentation.h"
 
-extern unsigned long InstrCount[]; // counters from instrumentation.c
+// Usage: perf_test [options] [WxH | N ...]
+//   --hw            add hardware counters (Linux perf events)
+//   --filter RE     run only the cases whose "test,type,imgA,imgB"
+//                   matches the (extended) regular expression RE
+//   --json FILE     also write the results to FILE, as JSON
+//   --warmup N      untimed runs before measuring (default 1)
+//   --min-reps N    repetitions, at least (default 5)
+//   --max-reps N    repetitions, at most (default 1000)
+//   --budget SEC    repeat until the case has run for SEC (default 0.05)
+//
+// Each case is repeated, and its CSV line reports the median cpu time
+// (time_sec), with p5, p95 and stddev, and the same for the wall-clock
+// time. The operation counters are those of the last repetition.
+
+static struct {
+  int warmup;
+  int min_reps;
+  int max_reps;
+  double budget;
+  int filter_set;
+  regex_t filter;
+  FILE *json;
+  int hw_columns;  // with --hw, empty when an event is not available
+} opt = {1, 5, 1000, 0.05, 0, {0}, NULL, 0};
+
+// Names of the operation counters, in the CSV and JSON.
+static const char *counter_names[NUMCOUNTERS] = {
+  "pixreads", "pixwrites", "lutreads", "lutwrites", "pixvalidations",
+  "stackops", "queueops", "peakstack", "peakqueue", "peakrecdepth"
+};
+
+// --- Benchmark harness ---
+//
+// A case is written as a loop, whose body sets up (untimed), runs the
+// operation between BENCH_START and BENCH_STOP, and cleans up:
+//
+//   BENCH("fill", "stack", name, "") {
+//     Image img = ImageCopy(white);
+//     BENCH_START();
+//     int painted = ImageRegionFillingWithSTACK(img, u, v, BLACK);
+//     BENCH_STOP(img, painted);
+//     ImageDestroy(&img);
+//   }
+//
+// The body runs for the warm-ups, then until both the minimum number of
+// repetitions and the time budget are reached; then the line is printed.
+#define BENCH(test, type, a, b) \
+  for (BenchBegin(test, type, a, b); BenchNext(); )
+#define BENCH_START() BenchStart()
+#define BENCH_STOP(img, result) BenchStop(img, result)
+
+typedef struct {
+  double cpu;
+  double wall;
+  long long hw[NUMHWCOUNTERS];
+} Sample;
+
+static struct {
+  const char *test, *type, *a, *b;
+  int skip;          // filtered out
+  int runs;          // completed runs, including warm-ups
+  int last_runs;     // runs at the previous BenchNext
+  double begin;      // wall time at BenchBegin
+  double wall0;      // wall time at BenchStart
+  Sample *samples;
+  int nsamples;
+  int capacity;
+  uint32 width, height;
+  int result;
+  unsigned long counts[NUMCOUNTERS];
+} bench;
+
+static int json_cases = 0;
 
 static void print_header(void) {
-  printf("test,type,imgA,imgB,width,height,pixels,result,time_sec,time_ctu,pixreads,pixwrites,lutreads,lutwrites,pixvalidations,stackops,queueops,peakstack,peakqueue,peakrecdepth\n");
+  printf("test,type,imgA,imgB,width,height,pixels,result,time_sec,time_ctu,pixreads,pixwrites,lutreads,lutwrites,pixvalidations,stackops,queueops,peakstack,peakqueue,peakrecdepth");
+  printf(",reps,time_p5,time_p95,time_stddev,wall_sec,wall_p5,wall_p95,wall_stddev");
+  for (int i = 0; opt.hw_columns && i < NUMHWCOUNTERS; i++)
+    printf(",%s", InstrHWName[i]);
+  printf("\n");
+}
+
+static void BenchBegin(const char *test, const char *type, const char *a, const char *b) {
+  bench.test = test;
+  bench.type = type;
+  bench.a = a;
+  bench.b = b;
+  bench.runs = 0;
+  bench.last_runs = -1;
+  bench.nsamples = 0;
+  bench.begin = wall_time();
+  bench.skip = 0;
+  if (opt.filter_set) {
+    char id[256];
+    snprintf(id, sizeof(id), "%s,%s,%s,%s", test, type, a, b);
+    bench.skip = regexec(&opt.filter, id, 0, NULL, 0) != 0;
+  }
+}
+
+static void BenchStart(void) {
+  InstrReset();
+  bench.wall0 = wall_time();
+}
+
+static void BenchStop(const Image img, int result) {
+  Sample s;
+  s.cpu = cpu_time() - InstrTime;
+  s.wall = wall_time() - bench.wall0;
+  InstrHWRead(s.hw);
+  InstrSnapshot(bench.counts);
+  bench.width = ImageWidth(img);
+  bench.height = ImageHeight(img);
+  bench.result = result;
+  if (bench.runs++ < opt.warmup)
+    return;
+  if (bench.nsamples == bench.capacity) {
+    bench.capacity = bench.capacity ? 2 * bench.capacity : 64;
+    bench.samples = realloc(bench.samples, bench.capacity * sizeof(Sample));
+    if (bench.samples == NULL) {
+      perror("perf_test");
+      exit(2);
+    }
+  }
+  bench.samples[bench.nsamples++] = s;
+}
+
+// Statistics of n values (sorted in place).
+typedef struct {
+  double median, p5, p95, stddev;
+} Stats;
+
+static int compare_doubles(const void *p, const void *q) {
+  double x = *(const double *)p;
+  double y = *(const double *)q;
+  return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of n sorted values.
+static double percentile(const double *v, int n, double p) {
+  int k = (int)ceil(p / 100.0 * n) - 1;
+  if (k < 0) k = 0;
+  if (k >= n) k = n - 1;
+  return v[k];
+}
+
+static Stats compute_stats(double *v, int n) {
+  Stats st;
+  qsort(v, n, sizeof(v[0]), compare_doubles);
+  st.median = (n % 2) ? v[n/2] : (v[n/2 - 1] + v[n/2]) / 2;
+  st.p5 = percentile(v, n, 5);
+  st.p95 = percentile(v, n, 95);
+  double mean = 0.0, sq = 0.0;
+  for (int i = 0; i < n; i++) mean += v[i];
+  mean /= n;
+  for (int i = 0; i < n; i++) sq += (v[i] - mean) * (v[i] - mean);
+  st.stddev = (n > 1) ? sqrt(sq / (n - 1)) : 0.0;
+  return st;
+}
+
+static void json_string(const char *s) {
+  fputc('"', opt.json);
+  for (; *s != '\0'; s++) {
+    if (*s == '"' || *s == '\\') fputc('\\', opt.json);
+    fputc(*s, opt.json);
+  }
+  fputc('"', opt.json);
 }
-static void print_line(const char *test, const char *type, const char *a, const char *b, const Image img, int result) {
-  double elapsed_sec = cpu_time() - InstrTime;
-  double elapsed_ctu = elapsed_sec / InstrCTU;
-  unsigned long pixels = (unsigned long)ImageWidth(img) * (unsigned long)ImageHeight(img);
-  printf("%s,%s,%s,%s,%u,%u,%lu,%d,%.6f,%.6f,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n",
-         test, type, a, b,
-         (unsigned)ImageWidth(img), (unsigned)ImageHeight(img), pixels, result,
-         elapsed_sec, elapsed_ctu,
-         InstrCount[0], InstrCount[1], InstrCount[2], InstrCount[3], InstrCount[4], InstrCount[5], InstrCount[6], InstrCount[7], InstrCount[8], InstrCount[9]);
+
+static void json_stats(const char *key, Stats st, int with_ctu) {
+  fprintf(opt.json, ",\"%s\":{\"median\":%.9f,\"p5\":%.9f,\"p95\":%.9f,\"stddev\":%.9f",
+          key, st.median, st.p5, st.p95, st.stddev);
+  if (with_ctu)
+    fprintf(opt.json, ",\"median_ctu\":%.9f", st.median / InstrCTU);
+  fprintf(opt.json, "}");
+}
+
+static void print_result(void) {
+  int n = bench.nsamples;
+  double *v = malloc(n * sizeof(double));
+  if (v == NULL) {
+    perror("perf_test");
+    exit(2);
+  }
+  for (int i = 0; i < n; i++) v[i] = bench.samples[i].cpu;
+  Stats cpu = compute_stats(v, n);
+  for (int i = 0; i < n; i++) v[i] = bench.samples[i].wall;
+  Stats wall = compute_stats(v, n);
+  // Hardware counts: median of the repetitions, -1 if not available
+  long long hw[NUMHWCOUNTERS];
+  for (int k = 0; k < NUMHWCOUNTERS; k++) {
+    hw[k] = -1;
+    int ok = 1;
+    for (int i = 0; i < n; i++) {
+      v[i] = (double)bench.samples[i].hw[k];
+      ok = ok && bench.samples[i].hw[k] >= 0;
+    }
+    if (ok) hw[k] = (long long)compute_stats(v, n).median;
+  }
+  free(v);
+
+  unsigned long pixels = (unsigned long)bench.width * bench.height;
+  unsigned long *c = bench.counts;
+  printf("%s,%s,%s,%s,%u,%u,%lu,%d,%.9f,%.9f,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu",
+         bench.test, bench.type, bench.a, bench.b,
+         (unsigned)bench.width, (unsigned)bench.height, pixels, bench.result,
+         cpu.median, cpu.median / InstrCTU,
+         c[0], c[1], c[2], c[3], c[4], c[5], c[6], c[7], c[8], c[9]);
+  printf(",%d,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f",
+         n, cpu.p5, cpu.p95, cpu.stddev, wall.median, wall.p5, wall.p95, wall.stddev);
+  for (int k = 0; opt.hw_columns && k < NUMHWCOUNTERS; k++) {
+    if (hw[k] >= 0)
+      printf(",%lld", hw[k]);
+    else
+      printf(",");
+  }
+  printf("\n");
+  fflush(stdout);
+
+  if (opt.json == NULL)
+    return;
+  fprintf(opt.json, "%s\n  {\"test\":", json_cases++ ? "," : "");
+  json_string(bench.test);
+  fprintf(opt.json, ",\"type\":");
+  json_string(bench.type);
+  fprintf(opt.json, ",\"imgA\":");
+  json_string(bench.a);
+  fprintf(opt.json, ",\"imgB\":");
+  json_string(bench.b);
+  fprintf(opt.json, ",\"width\":%u,\"height\":%u,\"pixels\":%lu,\"result\":%d,\"reps\":%d",
+          (unsigned)bench.width, (unsigned)bench.height, pixels, bench.result, n);
+  json_stats("cpu_sec", cpu, 1);
+  json_stats("wall_sec", wall, 0);
+  fprintf(opt.json, ",\"counters\":{");
+  for (int k = 0; k < NUMCOUNTERS; k++)
+    fprintf(opt.json, "%s\"%s\":%lu", k ? "," : "", counter_names[k], c[k]);
+  fprintf(opt.json, "}");
+  if (opt.hw_columns) {
+    fprintf(opt.json, ",\"hw\":{");
+    for (int k = 0; k < NUMHWCOUNTERS; k++) {
+      fprintf(opt.json, "%s\"%s\":", k ? "," : "", InstrHWName[k]);
+      if (hw[k] >= 0)
+        fprintf(opt.json, "%lld", hw[k]);
+      else
+        fprintf(opt.json, "null");
+    }
+    fprintf(opt.json, "}");
+  }
+  fprintf(opt.json, "}");
+}
+
+// Whether to run the case body (once more).
+static int BenchNext(void) {
+  if (bench.skip)
+    return 0;
+  if (bench.runs == bench.last_runs)  // the body did not reach BENCH_STOP
+    return 0;
+  bench.last_runs = bench.runs;
+  int n = bench.nsamples;
+  if (bench.runs <= opt.warmup || n < opt.min_reps)
+    return 1;
+  if (n < opt.max_reps && wall_time() - bench.begin < opt.budget)
+    return 1;
+  print_result();
+  return 0;
 }
 
 static void run_equal_tests(Image base, const char *name) {
   // Self equality (pointer check fast path)
-  InstrReset();
-  int r = ImageIsEqual(base, base);
-  print_line("ImageIsEqual", "self", name, name, base, r);
+  BENCH("ImageIsEqual", "self", name, name) {
+    BENCH_START();
+    int r = ImageIsEqual(base, base);
+    BENCH_STOP(base, r);
+  }
 
-  // Deep copy equality (forces full scan)
-  Image copy = ImageCopy(base);
-  InstrReset();
-  r = ImageIsEqual(base, copy);
-  print_line("ImageIsEqual", "deep_equal", name, "copy", base, r);
+  // Deep copy equality (forces full scan; no fingerprints are cached)
+  BENCH("ImageIsEqual", "deep_equal", name, "copy") {
+    Image copy = ImageCopy(base);
+    BENCH_START();
+    int r = ImageIsEqual(base, copy);
+    BENCH_STOP(base, r);
+    ImageDestroy(&copy);
+  }
 
   // Rotated version (likely early mismatch)
-  Image rot = ImageRotate180CW(base);
-  InstrReset();
-  r = ImageIsEqual(base, rot);
-  print_line("ImageIsEqual", "rotated", name, "rot180", base, r);
+  BENCH("ImageIsEqual", "rotated", name, "rot180") {
+    Image rot = ImageRotate180CW(base);
+    BENCH_START();
+    int r = ImageIsEqual(base, rot);
+    BENCH_STOP(base, r);
+    ImageDestroy(&rot);
+  }
+
+  // Computing a fingerprint (once per image, on a fresh copy)...
+  BENCH("ImageFingerprint", "fingerprint", name, "") {
+    Image copy = ImageCopy(base);
+    BENCH_START();
+    ImageFingerprint(copy);
+    BENCH_STOP(copy, 1);
+    ImageDestroy(&copy);
+  }
+
+  // ...and comparing images with cached fingerprints (O(1) mismatch)
+  BENCH("ImageIsEqual", "rotated_fingerprinted", name, "rot180") {
+    Image copy = ImageCopy(base);
+    Image rot = ImageRotate180CW(base);
+    ImageFingerprint(copy);
+    ImageFingerprint(rot);
+    BENCH_START();
+    int r = ImageIsEqual(copy, rot);
+    BENCH_STOP(base, r);
+    ImageDestroy(&rot);
+    ImageDestroy(&copy);
+  }
+
+  // The same rotation as a view, compared without materialising it
+  BENCH("ImageIsEqual", "rotated_view", "rot180", name) {
+    Image rot = ImageRotate180CW(base);
+    Image view = ImageView(base, ORIENT_ROTATE180);
+    BENCH_START();
+    int r = ImageIsEqual(rot, view);
+    BENCH_STOP(base, r);
+    ImageDestroy(&view);
+    ImageDestroy(&rot);
+  }
 
   // Different size (immediate mismatch)
   Image diffSize = ImageCreate(ImageWidth(base)+1, ImageHeight(base)+1);
-  InstrReset();
-  r = ImageIsEqual(base, diffSize);
-  print_line("ImageIsEqual", "size_diff", name, "bigger", base, r);
-
-  ImageDestroy(&copy);
-  ImageDestroy(&rot);
+  BENCH("ImageIsEqual", "size_diff", name, "bigger") {
+    BENCH_START();
+    int r = ImageIsEqual(base, diffSize);
+    BENCH_STOP(base, r);
+  }
   ImageDestroy(&diffSize);
 }
 
+static void run_rotate_tests(Image base, const char *name) {
+  const char *types[] = {"90", "180", "270", "transpose"};
+  Image (*rotations[])(const Image) = {ImageRotate90CW, ImageRotate180CW, ImageRotate270CW, ImageTranspose};
+  for (int i = 0; i < 4; i++) {
+    BENCH("rotate", types[i], name, "") {
+      BENCH_START();
+      Image r = rotations[i](base);
+      BENCH_STOP(r, 1);
+      ImageDestroy(&r);
+    }
+  }
+  // The same 90 degree rotation in place, on a copy made outside the timing
+  BENCH("rotate", "90_inplace", name, "") {
+    Image copy = ImageCopy(base);
+    BENCH_START();
+    ImageRotate90CWInPlace(copy);
+    BENCH_STOP(copy, 1);
+    ImageDestroy(&copy);
+  }
+}
+
+// Fill a copy of img from (u, v), with each of the four strategies.
+static void run_fills(Image img, const char *name, const char *seed, int u, int v, int recursive) {
+  const char *types[] = {"recursive", "stack", "queue", "scanline"};
+  FillingFunction fills[] = {ImageRegionFillingRecursive, ImageRegionFillingWithSTACK, ImageRegionFillingWithQUEUE, ImageRegionFillingScanline};
+  for (int i = recursive ? 0 : 1; i < 4; i++) {
+    BENCH("fill", types[i], name, seed) {
+      Image copy = ImageCopy(img);
+      BENCH_START();
+      int painted = fills[i](copy, u, v, BLACK);
+      BENCH_STOP(copy, painted);
+      ImageDestroy(&copy);
+    }
+  }
+}
+
 static void run_fill_tests(Image white, const char *name) {
   uint32 w = ImageWidth(white);
   uint32 h = ImageHeight(white);
-  int seed_u = (int)w/2;
-  int seed_v = (int)h/2;
-
-  // Recursive fill
-  Image img1 = ImageCopy(white);
-  InstrReset();
-  int painted = ImageRegionFillingRecursive(img1, seed_u, seed_v, BLACK);
-  print_line("fill", "recursive", name, "", img1, painted);
-  ImageDestroy(&img1);
+  run_fills(white, name, "", (int)w/2, (int)h/2, 1);
+}
 
-  // Stack fill
-  Image img2 = ImageCopy(white);
-  InstrReset();
-  painted = ImageRegionFillingWithSTACK(img2, seed_u, seed_v, BLACK);
-  print_line("fill", "stack", name, "", img2, painted);
-  ImageDestroy(&img2);
+// Segment a copy of img, with each fill strategy (recursive: only if
+// asked, as it overflows the stack on large images) and union-find.
+static void run_segmentations(Image img, const char *name, int recursive) {
+  const char *types[] = {"stack", "queue", "recursive", "scanline"};
+  FillingFunction fills[] = {ImageRegionFillingWithSTACK, ImageRegionFillingWithQUEUE, ImageRegionFillingRecursive, ImageRegionFillingScanline};
+  for (int i = 0; i < 4; i++) {
+    if (fills[i] == ImageRegionFillingRecursive && !recursive) continue;
+    BENCH("segment", types[i], name, "") {
+      Image s = ImageCopy(img);
+      BENCH_START();
+      int regions = ImageSegmentation(s, fills[i]);
+      BENCH_STOP(s, regions);
+      ImageDestroy(&s);
+    }
+  }
 
-  // Queue fill
-  Image img3 = ImageCopy(white);
-  InstrReset();
-  painted = ImageRegionFillingWithQUEUE(img3, seed_u, seed_v, BLACK);
-  print_line("fill", "queue", name, "", img3, painted);
-  ImageDestroy(&img3);
+  BENCH("segment", "unionfind", name, "") {
+    Image s = ImageCopy(img);
+    BENCH_START();
+    int regions = ImageSegmentationUnionFind(s);
+    BENCH_STOP(s, regions);
+    ImageDestroy(&s);
+  }
 }
 
 static void run_segmentation_tests(Image img, const char *name) {
-  // Using stack and queue variants for segmentation
-  Image s1 = ImageCopy(img);
-  InstrReset();
-  int regions = ImageSegmentation(s1, ImageRegionFillingWithSTACK);
-  print_line("segment", "stack", name, "", s1, regions);
-  ImageDestroy(&s1);
+  run_segmentations(img, name, 0);
 
-  Image s2 = ImageCopy(img);
-  InstrReset();
-  regions = ImageSegmentation(s2, ImageRegionFillingWithQUEUE);
-  print_line("segment", "queue", name, "", s2, regions);
-  ImageDestroy(&s2);
+  BENCH("segment", "unionfind_mt", name, "") {
+    Image s = ImageCopy(img);
+    BENCH_START();
+    int regions = ImageSegmentationParallel(s, 0);
+    BENCH_STOP(s, regions);
+    ImageDestroy(&s);
+  }
 
-  // CAUSES SEGMENTATION FAULT ON LARGE IMAGES DUE TO DEEP RECURSION
-  // Image s3 = ImageCopy(img);
-  // InstrReset();
-  // regions = ImageSegmentation(s3, ImageRegionFillingRecursive);
-  // print_line("segment", "recursive", name, "", s3, regions);
-  // ImageDestroy(&s3);
+  // RLE: only the segmentation of the runs is timed (not the conversion)
+  BENCH("segment", "rle", name, "") {
+    ImageRLE rle = ImageRLECreate(img);
+    BENCH_START();
+    int regions = ImageRLESegmentation(rle);
+    BENCH_STOP(img, regions);
+    ImageRLEDestroy(&rle);
+  }
+
+  // Context fills: one allocation for the whole segmentation
+  const char *ctx_types[] = {"stack_ctx", "queue_ctx", "scanline_ctx"};
+  FillingFunctionCtx ctx_fills[] = {ImageRegionFillingWithSTACKCtx, ImageRegionFillingWithQUEUECtx, ImageRegionFillingScanlineCtx};
+  for (int i = 0; i < 3; i++) {
+    BENCH("segment", ctx_types[i], name, "") {
+      Image s = ImageCopy(img);
+      BENCH_START();
+      FillContext ctx = FillContextCreate(s);
+      int regions = ImageSegmentationWithContext(s, ctx, ctx_fills[i]);
+      FillContextDestroy(&ctx);
+      BENCH_STOP(s, regions);
+      ImageDestroy(&s);
+    }
+  }
 }
 
 static void run_maze_tests(void) {
@@ -108,65 +453,20 @@ static void run_maze_tests(void) {
   // Equality tests
   run_equal_tests(maze, name);
   // Fill tests: seed near entrance (0,1) and center as a second case
-  int seed_u1 = 0, seed_v1 = 1;
-  int seed_u2 = (int)ImageWidth(maze)/2-1, seed_v2 = (int)ImageHeight(maze)/2;
-
-  // For fills, operate on copies to keep image intact per run
-  Image m1 = ImageCopy(maze);
-  InstrReset();
-  int painted = ImageRegionFillingWithSTACK(m1, seed_u1, seed_v1, BLACK);
-  print_line("fill", "stack", name, "seed01", m1, painted);
-  ImageDestroy(&m1);
+  run_fills(maze, name, "seed01", 0, 1, 1);
+  run_fills(maze, name, "seedCenter", (int)ImageWidth(maze)/2-1, (int)ImageHeight(maze)/2, 1);
 
-  Image m2 = ImageCopy(maze);
-  InstrReset();
-  painted = ImageRegionFillingWithSTACK(m2, seed_u2, seed_v2, BLACK);
-  print_line("fill", "stack", name, "seedCenter", m2, painted);
-  ImageDestroy(&m2);
+  // Segmentation (the maze is small enough for the recursive fill)
+  run_segmentations(maze, name, 1);
 
-  Image m3 = ImageCopy(maze);
-  InstrReset();
-  painted = ImageRegionFillingWithQUEUE(m3, seed_u1, seed_v1, BLACK);
-  print_line("fill", "queue", name, "seed01", m3, painted);
-  ImageDestroy(&m3);
-
-  Image m4 = ImageCopy(maze);
-  InstrReset();
-  painted = ImageRegionFillingWithQUEUE(m4, seed_u2, seed_v2, BLACK);
-  print_line("fill", "queue", name, "seedCenter", m4, painted);
-  ImageDestroy(&m4);
-
-  Image m5 = ImageCopy(maze);
-  InstrReset();
-  painted = ImageRegionFillingRecursive(m5, seed_u1, seed_v1, BLACK);
-  print_line("fill", "recursive", name, "seed01", m5, painted);
-  ImageDestroy(&m5);
-
-  Image m6 = ImageCopy(maze);
-  InstrReset();
-  painted = ImageRegionFillingRecursive(m6, seed_u2, seed_v2, BLACK);
-  print_line("fill", "recursive", name, "seedCenter", m6, painted);
-  ImageDestroy(&m6);
-
-  // Segmentation using stack and queue variants
-  Image s1 = ImageCopy(maze);
-  InstrReset();
-  int regions = ImageSegmentation(s1, ImageRegionFillingWithSTACK);
-  print_line("segment", "stack", name, "", s1, regions);
-  ImageDestroy(&s1);
-
-  Image s2 = ImageCopy(maze);
-  InstrReset();
-  regions = ImageSegmentation(s2, ImageRegionFillingWithQUEUE);
-  print_line("segment", "queue", name, "", s2, regions);
-  ImageDestroy(&s2);
+  BENCH("segment", "rle", name, "") {
+    ImageRLE rle = ImageRLECreate(maze);
+    BENCH_START();
+    int regions = ImageRLESegmentation(rle);
+    BENCH_STOP(maze, regions);
+    ImageRLEDestroy(&rle);
+  }
 
-  Image s3 = ImageCopy(maze);
-  InstrReset();
-  regions = ImageSegmentation(s3, ImageRegionFillingRecursive);
-  print_line("segment", "recursive", name, "", s3, regions);
-  ImageDestroy(&s3);
-  
   ImageDestroy(&maze);
 }
 static void run_suite_for_dims(int w, int h) {
@@ -184,6 +484,9 @@ static void run_suite_for_dims(int w, int h) {
   snprintf(name_white, sizeof(name_white), "white%dx%d", w, h);
   run_equal_tests(chess, name_chess);
   run_equal_tests(palete, name_palete);
+  run_rotate_tests(palete, name_palete);
+  run_rotate_tests(chess, name_chess);
+  run_rotate_tests(white, name_white);
   run_fill_tests(white, name_white);
   run_segmentation_tests(chess, name_chess);
   run_segmentation_tests(white, name_white);
@@ -192,12 +495,56 @@ static void run_suite_for_dims(int w, int h) {
   ImageDestroy(&white);
 }
 
+static void usage(void) {
+  fprintf(stderr, "Usage: perf_test [--hw] [--filter RE] [--json FILE] [--warmup N]\n"
+                  "                 [--min-reps N] [--max-reps N] [--budget SEC] [WxH | N ...]\n");
+  exit(2);
+}
+
 int main(int argc, char **argv) {
+  // Options first; the other arguments are image sizes
+  char **dims = malloc(argc * sizeof(char *));
+  int ndims = 0;
+  const char *json_path = NULL;
+  for (int i = 1; i < argc; ++i) {
+    char *arg = argv[i];
+    if (strcmp(arg, "--hw") == 0) {
+      opt.hw_columns = 1;
+    } else if (strncmp(arg, "--", 2) == 0) {
+      if (i + 1 >= argc) usage();
+      char *val = argv[++i];
+      if (strcmp(arg, "--filter") == 0) {
+        if (regcomp(&opt.filter, val, REG_EXTENDED | REG_NOSUB) != 0) {
+          fprintf(stderr, "perf_test: invalid regular expression: %s\n", val);
+          exit(2);
+        }
+        opt.filter_set = 1;
+      } else if (strcmp(arg, "--json") == 0) json_path = val;
+      else if (strcmp(arg, "--warmup") == 0) opt.warmup = atoi(val);
+      else if (strcmp(arg, "--min-reps") == 0) opt.min_reps = atoi(val);
+      else if (strcmp(arg, "--max-reps") == 0) opt.max_reps = atoi(val);
+      else if (strcmp(arg, "--budget") == 0) opt.budget = atof(val);
+      else usage();
+    } else {
+      dims[ndims++] = arg;
+    }
+  }
+  if (opt.warmup < 0 || opt.min_reps < 1 || opt.max_reps < opt.min_reps || opt.budget < 0)
+    usage();
+  if (json_path != NULL && (opt.json = fopen(json_path, "w")) == NULL) {
+    perror(json_path);
+    exit(2);
+  }
+
   ImageInit();
+  if (opt.hw_columns && InstrHWOpen() == 0)
+    fprintf(stderr, "perf_test: hardware counters not available\n");
+  if (opt.json != NULL)
+    fprintf(opt.json, "{\"ctu_sec\":%.9g,\"cases\":[", InstrCTU);
   print_header();
-  if (argc > 1) {
-    for (int i = 1; i < argc; ++i) {
-      char *arg = argv[i];
+  if (ndims > 0) {
+    for (int i = 0; i < ndims; ++i) {
+      char *arg = dims[i];
       int w=0,h=0;
       if (strchr(arg,'x') || strchr(arg,'X')) {
         char *x = strchr(arg,'x'); if (!x) x = strchr(arg,'X');
@@ -219,5 +566,13 @@ int main(int argc, char **argv) {
   }
   // Always attempt maze tests once per run
   run_maze_tests();
+
+  if (opt.json != NULL) {
+    fprintf(opt.json, "\n]}\n");
+    fclose(opt.json);
+  }
+  if (opt.filter_set) regfree(&opt.filter);
+  free(bench.samples);
+  free(dims);
   return 0;
 }